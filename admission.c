@@ -0,0 +1,244 @@
+/*
+ *   udrone - Multicast Device Remote Control
+ *   Copyright (C) 2019 John Crispin <blogic@openwrt.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "udrone.h"
+
+#define ADMIT_SOURCES		16
+
+/* Default token bucket rates in messages per second and burst sizes */
+#define ADMIT_SOURCE_RATE	50
+#define ADMIT_SOURCE_BURST	100
+#define ADMIT_CONTROL_RATE	200
+#define ADMIT_CONTROL_BURST	400
+#define ADMIT_COMMAND_RATE	100
+#define ADMIT_COMMAND_BURST	200
+#define ADMIT_FORK_RATE		5
+#define ADMIT_FORK_BURST	10
+
+struct admit_bucket {
+	int64_t last;
+	int64_t tokens;
+};
+
+struct admit_class {
+	const char *name;
+	int rate;
+	int burst;
+	struct admit_bucket b;
+	uint32_t passed;
+	uint32_t dropped;
+};
+
+/* Control messages get their own bucket so commands can't starve renewals */
+struct admit_source {
+	struct in_addr addr;
+	int64_t seen;
+	struct admit_bucket cmd;
+	struct admit_bucket ctrl;
+};
+
+static struct admit_class source_class = {
+	.name = "source",
+	.rate = ADMIT_SOURCE_RATE,
+	.burst = ADMIT_SOURCE_BURST,
+};
+
+static struct admit_class classes[__UDRONE_ADMIT_MAX] = {
+	[UDRONE_ADMIT_CONTROL] = {
+		.name = "control",
+		.rate = ADMIT_CONTROL_RATE,
+		.burst = ADMIT_CONTROL_BURST,
+	},
+	[UDRONE_ADMIT_COMMAND] = {
+		.name = "command",
+		.rate = ADMIT_COMMAND_RATE,
+		.burst = ADMIT_COMMAND_BURST,
+	},
+	[UDRONE_ADMIT_FORK] = {
+		.name = "fork",
+		.rate = ADMIT_FORK_RATE,
+		.burst = ADMIT_FORK_BURST,
+	},
+};
+
+static struct admit_source sources[ADMIT_SOURCES];
+static uint32_t source_evicted;
+
+static int64_t
+admit_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool
+admit_take(struct admit_bucket *b, int rate, int burst)
+{
+	int64_t now = admit_now();
+
+	/* Tokens are kept in 1/1000, so ms * rate refills exactly */
+	if (!b->last)
+		b->tokens = burst * 1000;
+	else
+		b->tokens += (now - b->last) * rate;
+	if (b->tokens > burst * 1000)
+		b->tokens = burst * 1000;
+	b->last = now;
+
+	if (b->tokens < 1000)
+		return false;
+
+	b->tokens -= 1000;
+	return true;
+}
+
+bool
+udrone_admit_source(struct in_addr addr, bool ctrl)
+{
+	struct admit_class *c = &source_class;
+	struct admit_source *s = NULL;
+	int i;
+
+	/* A drone farm is driven harder than any single device */
+	if (udrone.sim)
+		return true;
+
+	for (i = 0; i < ADMIT_SOURCES; i++) {
+		if (sources[i].addr.s_addr == addr.s_addr && sources[i].seen) {
+			s = &sources[i];
+			break;
+		}
+
+		/* Otherwise recycle the least recently seen source */
+		if (!s || sources[i].seen < s->seen)
+			s = &sources[i];
+	}
+
+	if (s->addr.s_addr != addr.s_addr || !s->seen) {
+		if (s->seen)
+			source_evicted++;
+		memset(s, 0, sizeof(*s));
+		s->addr = addr;
+	}
+	s->seen = admit_now();
+
+	if (!admit_take(ctrl ? &s->ctrl : &s->cmd, c->rate, c->burst)) {
+		c->dropped++;
+		return false;
+	}
+
+	c->passed++;
+	return true;
+}
+
+bool
+udrone_admit(int class)
+{
+	struct admit_class *c = &classes[class];
+
+	if (!admit_take(&c->b, c->rate, c->burst)) {
+		c->dropped++;
+		return false;
+	}
+
+	c->passed++;
+	return true;
+}
+
+/* Parse "<class>=<rate>/<burst>", e.g. "command=200/400" */
+int
+udrone_admit_config(const char *arg)
+{
+	struct admit_class *c = NULL;
+	const char *sep = strchr(arg, '=');
+	char *end;
+	long rate, burst;
+	int i;
+
+	if (!sep)
+		return -1;
+
+	if (!strncmp(arg, source_class.name, sep - arg) &&
+	    !source_class.name[sep - arg])
+		c = &source_class;
+
+	for (i = 0; !c && i < __UDRONE_ADMIT_MAX; i++)
+		if (!strncmp(arg, classes[i].name, sep - arg) &&
+		    !classes[i].name[sep - arg])
+			c = &classes[i];
+
+	if (!c)
+		return -1;
+
+	rate = strtol(sep + 1, &end, 10);
+	if (*end != '/' || rate <= 0 || rate > 100000)
+		return -1;
+
+	burst = strtol(end + 1, &end, 10);
+	if (*end || burst <= 0 || burst > 100000)
+		return -1;
+
+	c->rate = rate;
+	c->burst = burst;
+	return 0;
+}
+
+static int
+handler_admission(struct blob_attr **msg)
+{
+	void *c;
+	int i;
+
+	c = blobmsg_open_table(&udrone.out, source_class.name);
+	blobmsg_add_u32(&udrone.out, "passed", source_class.passed);
+	blobmsg_add_u32(&udrone.out, "dropped", source_class.dropped);
+	blobmsg_add_u32(&udrone.out, "evicted", source_evicted);
+	blobmsg_add_u32(&udrone.out, "rate", source_class.rate);
+	blobmsg_add_u32(&udrone.out, "burst", source_class.burst);
+	blobmsg_close_table(&udrone.out, c);
+
+	for (i = 0; i < __UDRONE_ADMIT_MAX; i++) {
+		c = blobmsg_open_table(&udrone.out, classes[i].name);
+		blobmsg_add_u32(&udrone.out, "passed", classes[i].passed);
+		blobmsg_add_u32(&udrone.out, "dropped", classes[i].dropped);
+		blobmsg_add_u32(&udrone.out, "rate", classes[i].rate);
+		blobmsg_add_u32(&udrone.out, "burst", classes[i].burst);
+		blobmsg_close_table(&udrone.out, c);
+	}
+
+	return UDRONE_DATAREPLY;
+}
+
+static struct udrone_registry admission_handler[] =
+{
+	{ .flags = UDRONE_HANDLER_ATOMIC, .type = "admission", .handler = handler_admission},
+	{ 0 }
+};
+
+static struct udrone_module admission = {
+	.registry = admission_handler,
+};
+UDRONE_MODULE_REGISTER(admission)
@@ -0,0 +1,464 @@
+/*
+ *   udrone - Multicast Device Remote Control
+ *   Copyright (C) 2019 John Crispin <blogic@openwrt.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+
+#include "udrone.h"
+
+#define SESSION_MAX		4
+#define SESSION_OUTPUT		8192
+#define SESSION_IDLE		300
+#define SESSION_TIMEOUT		5000
+#define SESSION_TIMEOUT_MAX	10000
+
+struct session {
+	char name[32];
+	struct udrone_channel *chan;
+	struct udrone_request *req;
+	struct uloop_process proc;
+	struct uloop_timeout idle;
+	struct uloop_fd out;
+	int idle_ms;
+	int in;
+	uint32_t serial;
+	char marker[48];
+	size_t len;
+	char buf[SESSION_OUTPUT + 64];
+};
+
+enum {
+	SESSION_NAME = 0,
+	SESSION_CMD,
+	SESSION_TIMEOUT_MS,
+	SESSION_IDLE_S,
+	__SESSION_MAX
+};
+
+static const struct blobmsg_policy session_policy[__SESSION_MAX] = {
+	[SESSION_NAME] = { .name = "name", .type = BLOBMSG_TYPE_STRING },
+	[SESSION_CMD] = { .name = "cmd", .type = BLOBMSG_TYPE_STRING },
+	[SESSION_TIMEOUT_MS] = { .name = "timeout", .type = BLOBMSG_TYPE_INT32 },
+	[SESSION_IDLE_S] = { .name = "idle", .type = BLOBMSG_TYPE_INT32 },
+};
+
+static struct session sessions[SESSION_MAX];
+
+/* Sessions are private to the channel that opened them */
+static struct session *
+session_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < SESSION_MAX; i++) {
+		if (!sessions[i].proc.pid || sessions[i].chan != udrone.cur)
+			continue;
+		if (!name || !strcmp(sessions[i].name, name))
+			return &sessions[i];
+	}
+
+	return NULL;
+}
+
+static void
+session_free(struct session *s)
+{
+	struct udrone_request *req = s->req;
+
+	uloop_timeout_cancel(&s->idle);
+	uloop_fd_delete(&s->out);
+	close(s->in);
+	close(s->out.fd);
+	memset(s, 0, sizeof(*s));
+
+	if (req)
+		udrone_request_complete(req, -EPIPE, NULL);
+}
+
+static void
+session_close(struct session *s)
+{
+	pid_t pid = s->proc.pid;
+
+	/* Commands started by the shell go along with it */
+	uloop_process_delete(&s->proc);
+	kill(-pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	session_free(s);
+}
+
+static void
+session_exit(struct uloop_process *p, int ret)
+{
+	kill(-p->pid, SIGKILL);
+	session_free(container_of(p, struct session, proc));
+}
+
+static void
+session_expire(struct uloop_timeout *t)
+{
+	session_close(container_of(t, struct session, idle));
+}
+
+static int
+session_spawn(struct session *s)
+{
+	int in[2], out[2];
+	pid_t pid;
+
+	if (pipe2(in, O_CLOEXEC))
+		return -errno;
+	if (pipe2(out, O_CLOEXEC)) {
+		close(in[0]);
+		close(in[1]);
+		return -errno;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		return -errno;
+	}
+
+	if (!pid) {
+		/* Own process group, so closing reaches every command */
+		setsid();
+		close(udrone.sock.fd);
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		dup2(out[1], STDERR_FILENO);
+		execl("/bin/sh", "sh", NULL);
+		_exit(127);
+	}
+
+	close(in[0]);
+	close(out[1]);
+	fcntl(out[0], F_SETFL, fcntl(out[0], F_GETFL) | O_NONBLOCK);
+	s->in = in[1];
+	s->out.fd = out[0];
+	s->proc.pid = pid;
+	s->proc.cb = session_exit;
+	uloop_process_add(&s->proc);
+
+	return 0;
+}
+
+static int
+session_write(struct session *s, const char *data, size_t len)
+{
+	struct sigaction sa = { .sa_handler = SIG_IGN }, old;
+	ssize_t ret = 0;
+
+	/* A shell that already exited must not take the daemon with it */
+	sigaction(SIGPIPE, &sa, &old);
+	while (len) {
+		ret = write(s->in, data, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			break;
+		data += ret;
+		len -= ret;
+	}
+	sigaction(SIGPIPE, &old, NULL);
+
+	return (ret < 0) ? -EPIPE : 0;
+}
+
+static int64_t
+session_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Returns 1 once the marker line of the running command was read */
+static int
+session_collect(struct session *s, int *code)
+{
+	char *m;
+	int ret;
+
+	while (1) {
+		if (s->len == sizeof(s->buf) - 1)
+			return -EMSGSIZE;
+
+		ret = read(s->out.fd, s->buf + s->len, sizeof(s->buf) - 1 - s->len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			return 0;
+		if (ret <= 0)
+			return -EPIPE;
+		s->len += ret;
+		s->buf[s->len] = 0;
+
+		/* The marker line is only complete once its newline arrived */
+		m = strstr(s->buf, s->marker);
+		if (m && strchr(m + strlen(s->marker), '\n')) {
+			*code = atoi(m + strlen(s->marker));
+			*m = 0;
+			return (m - s->buf > SESSION_OUTPUT) ? -EMSGSIZE : 1;
+		}
+	}
+}
+
+static int
+session_wait(struct session *s, int timeout, int *code)
+{
+	struct pollfd pfd = { .fd = s->out.fd, .events = POLLIN };
+	int64_t end = session_now() + timeout;
+	int ret;
+
+	while (!(ret = session_collect(s, code))) {
+		ret = poll(&pfd, 1, end - session_now());
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -ETIMEDOUT;
+	}
+
+	return (ret < 0) ? ret : 0;
+}
+
+static void
+session_done(struct session *s)
+{
+	uloop_fd_delete(&s->out);
+	uloop_timeout_set(&s->idle, s->idle_ms);
+}
+
+static void
+session_out_cb(struct uloop_fd *u, unsigned int events)
+{
+	struct session *s = container_of(u, struct session, out);
+	struct udrone_request *req = s->req;
+	static struct blob_buf b;
+	int code = 0, ret;
+
+	ret = session_collect(s, &code);
+	if (!ret)
+		return;
+
+	s->req = NULL;
+	if (ret < 0) {
+		session_close(s);
+		udrone_request_complete(req, ret, NULL);
+		return;
+	}
+
+	session_done(s);
+	blob_buf_init(&b, 0);
+	blobmsg_add_string(&b, "stdout", s->buf);
+	blobmsg_add_u32(&b, "code", code);
+	udrone_request_complete(req, UDRONE_DATAREPLY, b.head);
+}
+
+static void
+session_cancel(struct udrone_request *req)
+{
+	struct session *s = req->priv;
+
+	/* The command is still running, the shell can not be reused */
+	s->req = NULL;
+	session_close(s);
+}
+
+static int
+handler_session_open(struct blob_attr **msg)
+{
+	struct blob_attr *tb[__SESSION_MAX];
+	struct session *s;
+	char *name;
+	int ret;
+
+	if (!msg[MSG_DATA] || (blobmsg_type(msg[MSG_DATA]) != BLOBMSG_TYPE_TABLE))
+		return -EINVAL;
+
+	blobmsg_parse(session_policy, __SESSION_MAX, tb, blobmsg_data(msg[MSG_DATA]), blobmsg_len(msg[MSG_DATA]));
+	if (!tb[SESSION_NAME])
+		return -EINVAL;
+
+	name = blobmsg_get_string(tb[SESSION_NAME]);
+	if (!*name || strlen(name) >= sizeof(s->name))
+		return -EINVAL;
+
+	if (session_find(name))
+		return -EEXIST;
+
+	for (s = sessions; s < &sessions[SESSION_MAX] && s->proc.pid; s++)
+		;
+	if (s == &sessions[SESSION_MAX])
+		return -ENOSPC;
+
+	/* Shells count against the same fork rate as workers */
+	if (!udrone_admit(UDRONE_ADMIT_FORK))
+		return -EAGAIN;
+
+	ret = session_spawn(s);
+	if (ret)
+		return ret;
+
+	strcpy(s->name, name);
+	s->chan = udrone.cur;
+	s->idle.cb = session_expire;
+	s->idle_ms = SESSION_IDLE * 1000;
+	if (tb[SESSION_IDLE_S] && blobmsg_get_u32(tb[SESSION_IDLE_S]))
+		s->idle_ms = blobmsg_get_u32(tb[SESSION_IDLE_S]) * 1000;
+	uloop_timeout_set(&s->idle, s->idle_ms);
+
+	blobmsg_add_string(&udrone.out, "name", s->name);
+	blobmsg_add_u32(&udrone.out, "pid", s->proc.pid);
+
+	return UDRONE_DATAREPLY;
+}
+
+static int
+handler_session_exec(struct blob_attr **msg)
+{
+	struct blob_attr *tb[__SESSION_MAX];
+	struct udrone_request *req;
+	struct session *s;
+	char *cmd;
+	int timeout = SESSION_TIMEOUT;
+	int code = 0, ret;
+
+	if (!msg[MSG_DATA] || (blobmsg_type(msg[MSG_DATA]) != BLOBMSG_TYPE_TABLE))
+		return -EINVAL;
+
+	blobmsg_parse(session_policy, __SESSION_MAX, tb, blobmsg_data(msg[MSG_DATA]), blobmsg_len(msg[MSG_DATA]));
+	if (!tb[SESSION_NAME] || !tb[SESSION_CMD])
+		return -EINVAL;
+
+	s = session_find(blobmsg_get_string(tb[SESSION_NAME]));
+	if (!s)
+		return -ENOENT;
+	if (s->req)
+		return -EBUSY;
+
+	if (tb[SESSION_TIMEOUT_MS])
+		timeout = blobmsg_get_u32(tb[SESSION_TIMEOUT_MS]);
+	if (timeout <= 0 || timeout > SESSION_TIMEOUT_MAX)
+		timeout = SESSION_TIMEOUT_MAX;
+
+	/*
+	 * Commands run in the shell itself so cd and variables persist, the
+	 * exit code follows a marker that is unique to this command.
+	 */
+	snprintf(s->marker, sizeof(s->marker), "\n__udrone_%d_%u__ ", s->proc.pid, ++s->serial);
+	if (asprintf(&cmd, "{ %s\n} </dev/null\nprintf '\\n%s%%d\\n' $?\n",
+		     blobmsg_get_string(tb[SESSION_CMD]), s->marker + 1) < 0)
+		return -ENOMEM;
+
+	s->len = 0;
+	s->buf[0] = 0;
+	ret = session_write(s, cmd, strlen(cmd));
+	free(cmd);
+	if (ret) {
+		session_close(s);
+		return ret;
+	}
+
+	/* Collect the output from the event loop when the caller allows it */
+	uloop_timeout_cancel(&s->idle);
+	req = udrone_defer(msg, timeout);
+	if (req) {
+		s->req = req;
+		req->priv = s;
+		req->cancel = session_cancel;
+		s->out.cb = session_out_cb;
+		uloop_fd_add(&s->out, ULOOP_READ);
+		return UDRONE_DEFERRED;
+	}
+
+	/* Whatever is left in the pipe would corrupt the next command */
+	ret = session_wait(s, timeout, &code);
+	if (ret) {
+		session_close(s);
+		return ret;
+	}
+
+	session_done(s);
+	blobmsg_add_string(&udrone.out, "stdout", s->buf);
+	blobmsg_add_u32(&udrone.out, "code", code);
+
+	return UDRONE_DATAREPLY;
+}
+
+static int
+handler_session_close(struct blob_attr **msg)
+{
+	struct blob_attr *tb[__SESSION_MAX];
+	struct session *s;
+
+	if (!msg[MSG_DATA] || (blobmsg_type(msg[MSG_DATA]) != BLOBMSG_TYPE_TABLE))
+		return -EINVAL;
+
+	blobmsg_parse(session_policy, __SESSION_MAX, tb, blobmsg_data(msg[MSG_DATA]), blobmsg_len(msg[MSG_DATA]));
+	if (!tb[SESSION_NAME])
+		return -EINVAL;
+
+	s = session_find(blobmsg_get_string(tb[SESSION_NAME]));
+	if (!s)
+		return -ENOENT;
+
+	session_close(s);
+
+	return 0;
+}
+
+static void
+session_reset(struct udrone_channel *chan)
+{
+	int i;
+
+	for (i = 0; i < SESSION_MAX; i++)
+		if (sessions[i].proc.pid && sessions[i].chan == chan)
+			session_close(&sessions[i]);
+}
+
+static struct udrone_registry session_handler[] =
+{
+	{ .flags = UDRONE_HANDLER_ATOMIC, .type = "session_open", .handler = handler_session_open },
+	{ .flags = UDRONE_HANDLER_ATOMIC | UDRONE_HANDLER_DEFERRED, .type = "session_exec", .handler = handler_session_exec },
+	{ .flags = UDRONE_HANDLER_ATOMIC, .type = "session_close", .handler = handler_session_close },
+	{ 0 }
+};
+
+static struct udrone_module session = {
+	.registry = session_handler,
+	.reset = session_reset,
+};
+UDRONE_MODULE_REGISTER(session)
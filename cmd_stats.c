@@ -0,0 +1,289 @@
+/*
+ *   udrone - Multicast Device Remote Control
+ *   Copyright (C) 2019 John Crispin <blogic@openwrt.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <net/if.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "udrone.h"
+
+#define STATS_CARRIER_MAX	8
+
+struct stats_file {
+	const char *path;
+	int fd;
+};
+
+struct stats_carrier {
+	char ifname[IFNAMSIZ];
+	int fd;
+};
+
+enum {
+	STATS_FIELDS = 0,
+	STATS_IFACES,
+	__STATS_MAX
+};
+
+static const struct blobmsg_policy stats_policy[__STATS_MAX] = {
+	[STATS_FIELDS] = { .name = "fields", .type = BLOBMSG_TYPE_ARRAY },
+	[STATS_IFACES] = { .name = "ifaces", .type = BLOBMSG_TYPE_ARRAY },
+};
+
+static struct stats_file proc_stat = { .path = "/proc/stat", .fd = -1 };
+static struct stats_file proc_meminfo = { .path = "/proc/meminfo", .fd = -1 };
+static struct stats_file proc_netdev = { .path = "/proc/net/dev", .fd = -1 };
+static struct stats_carrier carrier[STATS_CARRIER_MAX];
+
+static const char *cpu_fields[] = {
+	"user", "nice", "system", "idle", "iowait", "irq", "softirq", "steal", NULL
+};
+
+static const char *mem_fields[] = {
+	"MemTotal", "MemFree", "MemAvailable", "Buffers", "Cached",
+	"SwapTotal", "SwapFree", NULL
+};
+
+/* Columns of /proc/net/dev, NULL entries are not reported */
+static const char *net_fields[] = {
+	"rx_bytes", "rx_packets", "rx_errors", "rx_dropped", NULL, NULL, NULL, "multicast",
+	"tx_bytes", "tx_packets", "tx_errors", "tx_dropped", NULL, "collisions", NULL, NULL,
+};
+
+static char buf[16 * 1024];
+
+static ssize_t
+stats_pread(int *fd, const char *path, char *buf, size_t size)
+{
+	ssize_t len;
+	int retry;
+
+	/* Files stay open, a failing descriptor is reopened once */
+	for (retry = 0; retry < 2; retry++) {
+		if (*fd < 0)
+			*fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (*fd < 0)
+			return -1;
+
+		len = pread(*fd, buf, size - 1, 0);
+		if (len >= 0) {
+			buf[len] = 0;
+			return len;
+		}
+
+		close(*fd);
+		*fd = -1;
+	}
+
+	return -1;
+}
+
+static const char *
+stats_u64(const char *p, uint64_t *val)
+{
+	while (*p == ' ' || *p == '\t')
+		p++;
+
+	*val = 0;
+	while (*p >= '0' && *p <= '9')
+		*val = *val * 10 + (*p++ - '0');
+
+	return p;
+}
+
+static const char *
+stats_eol(const char *p)
+{
+	while (*p && *p != '\n')
+		p++;
+
+	return *p ? p + 1 : p;
+}
+
+static bool
+stats_wanted(struct blob_attr *list, const char *name)
+{
+	struct blob_attr *cur;
+	int rem;
+
+	if (!list)
+		return true;
+
+	blobmsg_for_each_attr(cur, list, rem)
+		if (blobmsg_type(cur) == BLOBMSG_TYPE_STRING && !strcmp(blobmsg_get_string(cur), name))
+			return true;
+
+	return false;
+}
+
+static void
+stats_cpu(void)
+{
+	const char *p = buf;
+	uint64_t val;
+	void *c;
+	int i;
+
+	if (stats_pread(&proc_stat.fd, proc_stat.path, buf, sizeof(buf)) < 0 || strncmp(p, "cpu ", 4))
+		return;
+
+	p += 4;
+	c = blobmsg_open_table(&udrone.out, "cpu");
+	for (i = 0; cpu_fields[i]; i++) {
+		p = stats_u64(p, &val);
+		blobmsg_add_u64(&udrone.out, cpu_fields[i], val);
+	}
+	blobmsg_close_table(&udrone.out, c);
+}
+
+static void
+stats_mem(void)
+{
+	const char *p = buf;
+	uint64_t val;
+	void *c;
+	int i;
+
+	if (stats_pread(&proc_meminfo.fd, proc_meminfo.path, buf, sizeof(buf)) < 0)
+		return;
+
+	c = blobmsg_open_table(&udrone.out, "mem");
+	for (; *p; p = stats_eol(p)) {
+		for (i = 0; mem_fields[i]; i++) {
+			size_t len = strlen(mem_fields[i]);
+
+			if (strncmp(p, mem_fields[i], len) || p[len] != ':')
+				continue;
+
+			stats_u64(p + len + 1, &val);
+			blobmsg_add_u64(&udrone.out, mem_fields[i], val);
+			break;
+		}
+	}
+	blobmsg_close_table(&udrone.out, c);
+}
+
+static int
+stats_carrier(const char *ifname)
+{
+	char path[64], val[4];
+	int i;
+
+	for (i = 0; i < STATS_CARRIER_MAX; i++) {
+		struct stats_carrier *cr = &carrier[i];
+
+		if (*cr->ifname && strcmp(cr->ifname, ifname))
+			continue;
+
+		if (!*cr->ifname) {
+			strncpy(cr->ifname, ifname, sizeof(cr->ifname) - 1);
+			cr->fd = -1;
+		}
+
+		snprintf(path, sizeof(path), "/sys/class/net/%s/carrier", ifname);
+		if (stats_pread(&cr->fd, path, val, sizeof(val)) <= 0)
+			return -1;
+
+		return val[0] == '1';
+	}
+
+	return -1;
+}
+
+static void
+stats_net(struct blob_attr *ifaces)
+{
+	const char *p = buf;
+	char ifname[IFNAMSIZ];
+	void *c, *d;
+	int i;
+
+	if (stats_pread(&proc_netdev.fd, proc_netdev.path, buf, sizeof(buf)) < 0)
+		return;
+
+	/* Skip the two header lines */
+	p = stats_eol(stats_eol(p));
+
+	c = blobmsg_open_table(&udrone.out, "net");
+	for (; *p; p = stats_eol(p)) {
+		const char *name, *end;
+		uint64_t val;
+		int up;
+
+		for (name = p; *name == ' '; name++);
+		end = strchr(name, ':');
+		if (!end || end - name >= IFNAMSIZ)
+			continue;
+
+		memcpy(ifname, name, end - name);
+		ifname[end - name] = 0;
+		if (!stats_wanted(ifaces, ifname))
+			continue;
+
+		d = blobmsg_open_table(&udrone.out, ifname);
+		p = end + 1;
+		for (i = 0; i < ARRAY_SIZE(net_fields); i++) {
+			p = stats_u64(p, &val);
+			if (net_fields[i])
+				blobmsg_add_u64(&udrone.out, net_fields[i], val);
+		}
+
+		up = stats_carrier(ifname);
+		if (up >= 0)
+			blobmsg_add_u8(&udrone.out, "carrier", up);
+		blobmsg_close_table(&udrone.out, d);
+	}
+	blobmsg_close_table(&udrone.out, c);
+}
+
+static int
+handler_stats(struct blob_attr **msg)
+{
+	struct blob_attr *tb[__STATS_MAX] = { 0 };
+
+	if (msg[MSG_DATA] && (blobmsg_type(msg[MSG_DATA]) == BLOBMSG_TYPE_TABLE))
+		blobmsg_parse(stats_policy, __STATS_MAX, tb, blobmsg_data(msg[MSG_DATA]), blobmsg_len(msg[MSG_DATA]));
+
+	if (stats_wanted(tb[STATS_FIELDS], "cpu"))
+		stats_cpu();
+
+	if (stats_wanted(tb[STATS_FIELDS], "mem"))
+		stats_mem();
+
+	if (stats_wanted(tb[STATS_FIELDS], "net"))
+		stats_net(tb[STATS_IFACES]);
+
+	return UDRONE_DATAREPLY;
+}
+
+static struct udrone_registry stats_handler[] =
+{
+	{ .flags = UDRONE_HANDLER_ATOMIC, .type = "stats", .handler = handler_stats},
+	{ 0 }
+};
+
+static struct udrone_module stats = {
+	.registry = stats_handler,
+};
+UDRONE_MODULE_REGISTER(stats)
@@ -118,7 +118,7 @@ handler_system(struct blob_attr **msg)
 
 static struct udrone_registry system_handler[] =
 {
-	{ .type = "system", .handler = handler_system },
+	{ .type = "system", .handler = handler_system, .profile = "background" },
 	{ 0 }
 };
 
@@ -18,8 +18,26 @@
  *
  */
 
+#include <syslog.h>
+
 #include "udrone.h"
 
+#define UBUS_EVENT_MAX		8
+#define UBUS_EVENT_INTERVAL	1000
+
+struct ubus_event_sub {
+	struct ubus_event_handler ev;
+	struct uloop_timeout window;
+	struct udrone_channel *chan;
+	struct blob_attr *last;
+	uint32_t coalesced;
+	int interval;
+	char pattern[64];
+	char event[64];
+};
+
+static struct ubus_event_sub subs[UBUS_EVENT_MAX];
+
 enum {
 	UBUS_PATH = 0,
 	UBUS_METHOD,
@@ -35,6 +53,12 @@ static const struct blobmsg_policy ubus_policy[__UBUS_MAX] = {
 	[UBUS_TIMEOUT] = { .name = "timeout", .type = BLOBMSG_TYPE_INT32 },
 };
 
+struct ubus_deferred {
+	struct ubus_request ureq;
+	struct udrone_request *req;
+	struct blob_buf b;
+};
+
 static void
 ubus_data_handler(struct ubus_request *req, int type, struct blob_attr *msg)
 {
@@ -46,10 +70,72 @@ ubus_data_handler(struct ubus_request *req, int type, struct blob_attr *msg)
 		blobmsg_add_blob(&udrone.out, cur);
 }
 
+static void
+ubus_deferred_data(struct ubus_request *ureq, int type, struct blob_attr *msg)
+{
+	struct ubus_deferred *d = container_of(ureq, struct ubus_deferred, ureq);
+	struct blob_attr *cur;
+	int rem;
+
+	blobmsg_for_each_attr(cur, msg, rem)
+		blobmsg_add_blob(&d->b, cur);
+}
+
+static void
+ubus_deferred_free(struct ubus_deferred *d)
+{
+	blob_buf_free(&d->b);
+	free(d);
+}
+
+static void
+ubus_deferred_complete(struct ubus_request *ureq, int ret)
+{
+	struct ubus_deferred *d = container_of(ureq, struct ubus_deferred, ureq);
+
+	udrone_request_complete(d->req, ret ? -EINVAL : UDRONE_DATAREPLY, d->b.head);
+	ubus_deferred_free(d);
+}
+
+static void
+ubus_deferred_cancel(struct udrone_request *req)
+{
+	struct ubus_deferred *d = req->priv;
+
+	ubus_abort_request(&udrone.ubus.ctx, &d->ureq);
+	ubus_deferred_free(d);
+}
+
+static int
+ubus_invoke_deferred(struct udrone_request *req, unsigned int id, char *method, struct blob_attr *param)
+{
+	struct ubus_deferred *d;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return -ENOMEM;
+
+	blob_buf_init(&d->b, 0);
+	if (ubus_invoke_async(&udrone.ubus.ctx, id, method, param, &d->ureq)) {
+		ubus_deferred_free(d);
+		return -EINVAL;
+	}
+
+	d->req = req;
+	d->ureq.data_cb = ubus_deferred_data;
+	d->ureq.complete_cb = ubus_deferred_complete;
+	req->priv = d;
+	req->cancel = ubus_deferred_cancel;
+	ubus_complete_request_async(&udrone.ubus.ctx, &d->ureq);
+
+	return UDRONE_DEFERRED;
+}
+
 static int
 handler_ubus(struct blob_attr **msg)
 {
 	struct blob_attr *tb[__UBUS_MAX];
+	struct udrone_request *req;
 	char *path, *method;
 	int timeout = 2000;
 	unsigned int id;
@@ -70,18 +156,213 @@ handler_ubus(struct blob_attr **msg)
 	if (ubus_lookup_id(&udrone.ubus.ctx, path, &id))
 		return -ENOENT;
 
+	/* Wait for the reply in the event loop when the caller allows it */
+	req = udrone_defer(msg, timeout);
+	if (req)
+		return ubus_invoke_deferred(req, id, method, blobmsg_data(tb[UBUS_PARAM]));
+
 	ret = ubus_invoke(&udrone.ubus.ctx, id, method, blobmsg_data(tb[UBUS_PARAM]), ubus_data_handler, NULL, timeout);
 
 	return ret ? -EINVAL : UDRONE_DATAREPLY;
 }
 
+enum {
+	UBUS_SUB_PATTERN = 0,
+	UBUS_SUB_INTERVAL,
+	__UBUS_SUB_MAX
+};
+
+static const struct blobmsg_policy ubus_sub_policy[__UBUS_SUB_MAX] = {
+	[UBUS_SUB_PATTERN] = { .name = "pattern", .type = BLOBMSG_TYPE_STRING },
+	[UBUS_SUB_INTERVAL] = { .name = "interval", .type = BLOBMSG_TYPE_INT32 },
+};
+
+static void
+ubus_event_notify(struct ubus_event_sub *sub, const char *event, struct blob_attr *msg)
+{
+	struct blob_attr *cur;
+	void *c, *d;
+	int rem;
+
+	udrone_prepare_notice(sub->chan, "event");
+	c = blobmsg_open_table(&udrone.out, "data");
+	blobmsg_add_string(&udrone.out, "pattern", sub->pattern);
+	blobmsg_add_string(&udrone.out, "event", event);
+	blobmsg_add_u32(&udrone.out, "coalesced", sub->coalesced);
+	d = blobmsg_open_table(&udrone.out, "msg");
+	blobmsg_for_each_attr(cur, msg, rem)
+		blobmsg_add_blob(&udrone.out, cur);
+	blobmsg_close_table(&udrone.out, d);
+	blobmsg_close_table(&udrone.out, c);
+
+	udrone_send(udrone.out.head, &sub->chan->addr);
+	sub->coalesced = 0;
+}
+
+static void
+ubus_event_window(struct uloop_timeout *t)
+{
+	struct ubus_event_sub *sub = container_of(t, struct ubus_event_sub, window);
+
+	if (!sub->last)
+		return;
+
+	/* Flush the last event of the burst and open a new window */
+	ubus_event_notify(sub, sub->event, sub->last);
+	free(sub->last);
+	sub->last = NULL;
+	uloop_timeout_set(&sub->window, sub->interval);
+}
+
+static void
+ubus_event_cb(struct ubus_context *ctx, struct ubus_event_handler *ev,
+	      const char *type, struct blob_attr *msg)
+{
+	struct ubus_event_sub *sub = container_of(ev, struct ubus_event_sub, ev);
+
+	if (!sub->window.pending) {
+		ubus_event_notify(sub, type, msg);
+		uloop_timeout_set(&sub->window, sub->interval);
+		return;
+	}
+
+	/* Rate limited, the last value wins */
+	if (sub->last)
+		sub->coalesced++;
+	free(sub->last);
+	sub->last = blob_memdup(msg);
+	strncpy(sub->event, type, sizeof(sub->event) - 1);
+}
+
+static void
+ubus_event_free(struct ubus_event_sub *sub)
+{
+	ubus_unregister_event_handler(&udrone.ubus.ctx, &sub->ev);
+	uloop_timeout_cancel(&sub->window);
+	free(sub->last);
+	memset(sub, 0, sizeof(*sub));
+}
+
+static struct ubus_event_sub *
+ubus_event_find(struct udrone_channel *chan, const char *pattern)
+{
+	int i;
+
+	for (i = 0; i < UBUS_EVENT_MAX; i++)
+		if (subs[i].chan == chan && (!pattern || !strcmp(subs[i].pattern, pattern)))
+			return &subs[i];
+
+	return NULL;
+}
+
+static int
+handler_ubus_subscribe(struct blob_attr **msg)
+{
+	struct blob_attr *tb[__UBUS_SUB_MAX];
+	struct ubus_event_sub *sub;
+	int interval = UBUS_EVENT_INTERVAL;
+	char *pattern;
+
+	/* Virtual drones have no channel to deliver events to */
+	if (!udrone.cur)
+		return -ENOTSUP;
+
+	if (!msg[MSG_DATA] || (blobmsg_type(msg[MSG_DATA]) != BLOBMSG_TYPE_TABLE))
+		return -EINVAL;
+
+	blobmsg_parse(ubus_sub_policy, __UBUS_SUB_MAX, tb, blobmsg_data(msg[MSG_DATA]), blobmsg_len(msg[MSG_DATA]));
+	if (!tb[UBUS_SUB_PATTERN])
+		return -EINVAL;
+
+	pattern = blobmsg_get_string(tb[UBUS_SUB_PATTERN]);
+	if (strlen(pattern) >= sizeof(sub->pattern))
+		return -EINVAL;
+
+	/* Without a window every event of a burst would be forwarded */
+	if (tb[UBUS_SUB_INTERVAL])
+		interval = blobmsg_get_u32(tb[UBUS_SUB_INTERVAL]);
+	if (interval <= 0)
+		return -EINVAL;
+
+	sub = ubus_event_find(udrone.cur, pattern);
+	if (!sub) {
+		sub = ubus_event_find(NULL, NULL);
+		if (!sub)
+			return -ENOSPC;
+
+		sub->chan = udrone.cur;
+		strcpy(sub->pattern, pattern);
+		sub->ev.cb = ubus_event_cb;
+		sub->window.cb = ubus_event_window;
+		if (ubus_register_event_handler(&udrone.ubus.ctx, &sub->ev, pattern)) {
+			memset(sub, 0, sizeof(*sub));
+			return -EIO;
+		}
+	}
+
+	sub->interval = interval;
+
+	return 0;
+}
+
+static int
+handler_ubus_unsubscribe(struct blob_attr **msg)
+{
+	struct blob_attr *tb[__UBUS_SUB_MAX];
+	struct ubus_event_sub *sub;
+	char *pattern = NULL;
+
+	if (!udrone.cur)
+		return -ENOTSUP;
+
+	if (msg[MSG_DATA] && (blobmsg_type(msg[MSG_DATA]) == BLOBMSG_TYPE_TABLE)) {
+		blobmsg_parse(ubus_sub_policy, __UBUS_SUB_MAX, tb, blobmsg_data(msg[MSG_DATA]), blobmsg_len(msg[MSG_DATA]));
+		if (tb[UBUS_SUB_PATTERN])
+			pattern = blobmsg_get_string(tb[UBUS_SUB_PATTERN]);
+	}
+
+	/* Without a pattern all subscriptions of the channel are dropped */
+	if (pattern && !ubus_event_find(udrone.cur, pattern))
+		return -ENOENT;
+
+	while ((sub = ubus_event_find(udrone.cur, pattern)))
+		ubus_event_free(sub);
+
+	return 0;
+}
+
+static void
+ubus_reset(struct udrone_channel *chan)
+{
+	struct ubus_event_sub *sub;
+
+	while ((sub = ubus_event_find(chan, NULL)))
+		ubus_event_free(sub);
+}
+
+static void
+ubus_connect(void)
+{
+	int i;
+
+	/* Event registrations do not survive a reconnect of the bus */
+	for (i = 0; i < UBUS_EVENT_MAX; i++)
+		if (subs[i].chan &&
+		    ubus_register_event_handler(&udrone.ubus.ctx, &subs[i].ev, subs[i].pattern))
+			syslog(LOG_WARNING, "Failed to resubscribe to %s", subs[i].pattern);
+}
+
 static struct udrone_registry ubus_handler[] =
 {
-	{ .flags = UDRONE_HANDLER_ATOMIC, .type = "ubus", .handler = handler_ubus},
+	{ .flags = UDRONE_HANDLER_ATOMIC | UDRONE_HANDLER_DEFERRED, .type = "ubus", .handler = handler_ubus},
+	{ .flags = UDRONE_HANDLER_ATOMIC, .type = "ubus_subscribe", .handler = handler_ubus_subscribe},
+	{ .flags = UDRONE_HANDLER_ATOMIC, .type = "ubus_unsubscribe", .handler = handler_ubus_unsubscribe},
 	{ 0 }
 };
 
 static struct udrone_module ubus = {
 	.registry = ubus_handler,
+	.reset = ubus_reset,
+	.connect = ubus_connect,
 };
 UDRONE_MODULE_REGISTER(ubus)
@@ -28,6 +28,7 @@ enum {
 	UCI_CONFIG = 0,
 	UCI_SECTION,
 	UCI_TYPE,
+	UCI_HASHES,
 	__UCI_MAX
 };
 
@@ -35,8 +36,85 @@ static const struct blobmsg_policy uci_policy[__UCI_MAX] = {
 	[UCI_CONFIG] = { .name = "config", .type = BLOBMSG_TYPE_STRING },
 	[UCI_SECTION] = { .name = "section", .type = BLOBMSG_TYPE_STRING },
 	[UCI_TYPE] = { .name = "type", .type = BLOBMSG_TYPE_STRING },
+	[UCI_HASHES] = { .name = "hashes", .type = BLOBMSG_TYPE_TABLE },
 };
 
+static uint32_t
+uci_hash_str(const char *str, uint32_t hash)
+{
+	/* Include the 0-Byte so that adjacent strings cannot run together */
+	return udrone_hash(str, strlen(str) + 1, hash);
+}
+
+static uint32_t
+uci_section_hash(struct uci_section *s)
+{
+	uint32_t hash = uci_hash_str(s->type, UDRONE_HASH_INIT);
+	struct uci_element *_o;
+
+	uci_foreach_element(&s->options, _o) {
+		struct uci_option *o = uci_to_option(_o);
+		uint8_t t = o->type;
+
+		hash = uci_hash_str(_o->name, hash);
+		hash = udrone_hash(&t, sizeof(t), hash);
+		if (o->type == UCI_TYPE_STRING) {
+			hash = uci_hash_str(o->v.string, hash);
+		} else if (o->type == UCI_TYPE_LIST) {
+			struct uci_element *_l;
+
+			uci_foreach_element(&o->v.list, _l)
+				hash = uci_hash_str(_l->name, hash);
+		}
+	}
+
+	return hash;
+}
+
+static char *
+uci_hash_hex(char *buf, uint32_t hash)
+{
+	snprintf(buf, 9, "%08x", hash);
+	return buf;
+}
+
+static bool
+uci_section_match(struct uci_section *s, const char *type, const char *section)
+{
+	if (type && strcmp(s->type, type))
+		return false;
+
+	if (section && strcmp(s->e.name, section))
+		return false;
+
+	return true;
+}
+
+static struct uci_section *
+uci_section_find(struct uci_package *pkg, const char *name)
+{
+	struct uci_element *_s;
+
+	uci_foreach_element(&pkg->sections, _s)
+		if (!strcmp(_s->name, name))
+			return uci_to_section(_s);
+
+	return NULL;
+}
+
+static const char *
+uci_known_hash(struct blob_attr *hashes, const char *name)
+{
+	struct blob_attr *cur;
+	int rem;
+
+	blobmsg_for_each_attr(cur, hashes, rem)
+		if (blobmsg_type(cur) == BLOBMSG_TYPE_STRING && !strcmp(blobmsg_name(cur), name))
+			return blobmsg_get_string(cur);
+
+	return NULL;
+}
+
 static int
 handler_uci_set(struct blob_attr **msg)
 {
@@ -118,13 +196,19 @@ handler_uci_get(struct blob_attr **msg)
 	uci_foreach_element(&pkg->sections, _s) {
 		struct uci_section *s = uci_to_section(_s);
 		struct uci_element *_o;
+		const char *known;
+		char hash[9];
 		void *c;
 
-		if (type && strcmp(s->type, type))
+		if (!uci_section_match(s, type, section))
 			continue;
 
-		if (section && strcmp(s->e.name, section))
-			continue;
+		/* Skip sections the master already has */
+		if (tb[UCI_HASHES]) {
+			known = uci_known_hash(tb[UCI_HASHES], s->e.name);
+			if (known && !strcmp(known, uci_hash_hex(hash, uci_section_hash(s))))
+				continue;
+		}
 
 		c = blobmsg_open_table(&udrone.out, s->e.name);
 		blobmsg_add_string(&udrone.out, ".type", s->type);
@@ -147,6 +231,21 @@ handler_uci_get(struct blob_attr **msg)
 		blobmsg_close_table(&udrone.out, c);
 	}
 
+	if (tb[UCI_HASHES]) {
+		struct blob_attr *cur;
+		void *d;
+		int rem;
+
+		d = blobmsg_open_array(&udrone.out, ".deleted");
+		blobmsg_for_each_attr(cur, tb[UCI_HASHES], rem) {
+			struct uci_section *s = uci_section_find(pkg, blobmsg_name(cur));
+
+			if (!s || !uci_section_match(s, type, section))
+				blobmsg_add_string(&udrone.out, NULL, blobmsg_name(cur));
+		}
+		blobmsg_close_array(&udrone.out, d);
+	}
+
 err_out:
 	if (pkg)
 		uci_unload(uci, pkg);
@@ -154,10 +253,65 @@ err_out:
 	return ret;
 }
 
+static int
+handler_uci_hash(struct blob_attr **msg)
+{
+	char *type = NULL, *section = NULL;
+	struct blob_attr *tb[__UCI_MAX];
+	struct uci_package *pkg = NULL;
+	struct uci_context *uci;
+	struct uci_element *_s;
+	uint32_t pkg_hash = UDRONE_HASH_INIT;
+	char hash[9];
+	void *c;
+
+	if (!msg[MSG_DATA] || (blobmsg_type(msg[MSG_DATA]) != BLOBMSG_TYPE_TABLE))
+		return -EINVAL;
+
+	blobmsg_parse(uci_policy, __UCI_MAX, tb, blobmsg_data(msg[MSG_DATA]), blobmsg_len(msg[MSG_DATA]));
+	if (!tb[UCI_CONFIG])
+		return -EINVAL;
+
+	if (tb[UCI_SECTION])
+		section = blobmsg_get_string(tb[UCI_SECTION]);
+
+	if (tb[UCI_TYPE])
+		type = blobmsg_get_string(tb[UCI_TYPE]);
+
+	uci = uci_alloc_context();
+	if (uci_load(uci, blobmsg_get_string(tb[UCI_CONFIG]), &pkg)) {
+		uci_free_context(uci);
+		return -ENOENT;
+	}
+
+	c = blobmsg_open_table(&udrone.out, "sections");
+	uci_foreach_element(&pkg->sections, _s) {
+		struct uci_section *s = uci_to_section(_s);
+
+		if (!uci_section_match(s, type, section))
+			continue;
+
+		uci_hash_hex(hash, uci_section_hash(s));
+		blobmsg_add_string(&udrone.out, s->e.name, hash);
+
+		/* The package hash covers section order and names */
+		pkg_hash = uci_hash_str(s->e.name, pkg_hash);
+		pkg_hash = uci_hash_str(hash, pkg_hash);
+	}
+	blobmsg_close_table(&udrone.out, c);
+	blobmsg_add_string(&udrone.out, "hash", uci_hash_hex(hash, pkg_hash));
+
+	uci_unload(uci, pkg);
+	uci_free_context(uci);
+
+	return UDRONE_DATAREPLY;
+}
+
 static struct udrone_registry uci_handler[] =
 {
 	{ .flags = UDRONE_HANDLER_ATOMIC, .type = "uci_get", .handler = handler_uci_get},
 	{ .flags = UDRONE_HANDLER_ATOMIC, .type = "uci_set", .handler = handler_uci_set},
+	{ .flags = UDRONE_HANDLER_ATOMIC, .type = "uci_hash", .handler = handler_uci_hash},
 	{ 0 }
 };
 
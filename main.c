@@ -0,0 +1,155 @@
+/*
+ *   udrone - Multicast Device Remote Control
+ *   Copyright (C) 2010 Steven Barth <steven@midlink.org>
+ *   Copyright (C) 2010-2019 John Crispin <blogic@openwrt.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "udrone.h"
+
+static int
+udrone_group_range(const char *range)
+{
+	char buf[32], *p;
+	int bits;
+
+	strncpy(buf, range, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = 0;
+	p = strchr(buf, '/');
+	if (!p)
+		return -1;
+	*p++ = 0;
+	bits = atoi(p);
+
+	if (bits < 4 || bits > 32 || inet_pton(AF_INET, buf, &udrone.group_net) != 1 ||
+	    !IN_MULTICAST(ntohl(udrone.group_net.s_addr)))
+		return -1;
+
+	/* A /32 range disables per-group addresses */
+	udrone.group_mask = (bits == 32) ? 0 : (0xffffffffu >> bits);
+	udrone.group_net.s_addr &= htonl(~udrone.group_mask);
+
+	return 0;
+}
+
+static void
+ubus_connect_handler(struct ubus_context *ctx)
+{
+	udrone_connect();
+}
+
+static int
+usage(const char *prog)
+{
+	fprintf(stderr, "udrone - Multicast drone client\n\n"
+		"Usage: %s [options] <interface> [board]\n"
+		"Options:\n"
+		"\t-a <class>=<rate>/<burst>\n"
+		"\t\t\tAdmission limit per second for source, control,\n"
+		"\t\t\tcommand or fork (repeatable)\n"
+		"\t-l\t\tLow latency mode (busy polling, CS6 marking)\n"
+		"\t-r <net>/<bits>\tMulticast range for group addresses (default %s)\n"
+		"\t-s <count>\tSimulate a farm of virtual drones\n"
+		"\t-d <ms>\t\tSynthetic handler latency of virtual drones\n"
+		"\t-p <percent>\tSynthetic packet loss of virtual drones\n",
+		prog, UDRONE_GROUP_NET);
+	return EXIT_FAILURE;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *prog = *argv;
+	int sim = 0, latency = 0, loss = 0;
+	int ch;
+
+	udrone_group_range(UDRONE_GROUP_NET);
+
+	while ((ch = getopt(argc, argv, "a:d:lp:r:s:")) != -1) {
+		switch (ch) {
+		case 'a':
+			if (udrone_admit_config(optarg)) {
+				fprintf(stderr, "Invalid admission limit %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'd':
+			latency = atoi(optarg);
+			break;
+		case 'l':
+			udrone.lowlat = true;
+			break;
+		case 'p':
+			loss = atoi(optarg);
+			break;
+		case 'r':
+			if (udrone_group_range(optarg)) {
+				fprintf(stderr, "Invalid group range %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			sim = atoi(optarg);
+			break;
+		default:
+			return usage(prog);
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc < 2 || sim < 0 || latency < 0 || loss < 0 || loss > 100)
+		return usage(prog);
+
+	if (argc > 2)
+		strncpy(udrone.board, argv[2], sizeof(udrone.board) - 1);
+	else
+		strncpy(udrone.board, "generic", sizeof(udrone.board) - 1);
+
+	udrone.ifname = argv[1];
+
+	uloop_init();
+	udrone.ubus.cb = ubus_connect_handler;
+        ubus_auto_connect(&udrone.ubus);
+
+	if (udrone_init())
+		return EXIT_FAILURE;
+
+	udrone_socket();
+	if (sim) {
+		/* Virtual drones never fork, so no cgroups are needed */
+		if (udrone_sim_init(sim, latency, loss))
+			return EXIT_FAILURE;
+	} else {
+		udrone_profile_init();
+		udrone_generate_id();
+	}
+	uloop_run();
+	uloop_done();
+	ubus_auto_shutdown(&udrone.ubus);
+
+	udrone_done();
+	close(udrone.sock.fd);
+
+	return 0;
+}
@@ -0,0 +1,255 @@
+/*
+ *   udrone - Multicast Device Remote Control
+ *   Copyright (C) 2019 John Crispin <blogic@openwrt.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "udrone.h"
+
+#define UDRONE_CGROUP		"/sys/fs/cgroup"
+#define UDRONE_CGROUP_NAME	"udrone"
+#define UDRONE_CGROUP_SELF	"daemon"
+
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_CLASS_SHIFT	13
+
+enum {
+	IOPRIO_CLASS_NONE = 0,
+	IOPRIO_CLASS_RT,
+	IOPRIO_CLASS_BE,
+	IOPRIO_CLASS_IDLE,
+};
+
+static const struct udrone_profile profiles[] = {
+	{ .name = "default" },
+	{
+		.name = "background",
+		.nice = 10,
+		.ioprio_class = IOPRIO_CLASS_BE,
+		.ioprio = 7,
+		.cpu_max = "50000 100000",
+		.memory_max = "32M",
+	}, {
+		.name = "idle",
+		.nice = 19,
+		.ioprio_class = IOPRIO_CLASS_IDLE,
+		.cpu_max = "10000 100000",
+		.memory_max = "16M",
+		.cpus = 0x1,
+	},
+	{ 0 }
+};
+
+static bool cgroup_ok;
+static char cgroup_base[256];
+
+static int
+profile_write(const char *path, const char *val)
+{
+	int fd = open(path, O_WRONLY);
+	int ret = 0;
+
+	if (fd < 0)
+		return -errno;
+
+	if (write(fd, val, strlen(val)) < 0)
+		ret = -errno;
+	close(fd);
+
+	return ret;
+}
+
+static void
+profile_cgroup_path(char *buf, size_t len, const struct udrone_profile *p, const char *file)
+{
+	snprintf(buf, len, "%s/%s%s%s", cgroup_base,
+		 p->name, file ? "/" : "", file ? file : "");
+}
+
+/* Our own cgroup v2 directory from the "0::/path" line */
+static bool
+profile_cgroup_self(char *buf, size_t len)
+{
+	char line[256];
+	bool ret = false;
+	FILE *f;
+
+	f = fopen("/proc/self/cgroup", "r");
+	if (!f)
+		return false;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "0::", 3) != 0)
+			continue;
+
+		line[strcspn(line, "\n")] = 0;
+		ret = snprintf(buf, len, UDRONE_CGROUP "%s", line + 3) < len;
+		break;
+	}
+	fclose(f);
+
+	return ret;
+}
+
+const struct udrone_profile *
+udrone_profile_find(const char *name)
+{
+	const struct udrone_profile *p;
+
+	if (!name)
+		return NULL;
+
+	for (p = profiles; p->name; p++)
+		if (!strcmp(p->name, name))
+			return p;
+
+	return NULL;
+}
+
+void
+udrone_profile_init(void)
+{
+	const struct udrone_profile *p;
+	char path[320], *sep;
+
+	if (!profile_cgroup_self(cgroup_base, sizeof(cgroup_base))) {
+		syslog(LOG_INFO, "No cgroup v2 support, profiles will not limit resources");
+		return;
+	}
+
+	/*
+	 * Profiles live below the cgroup we were started in, the root
+	 * cgroup is left alone. Controllers can only be enabled for a
+	 * cgroup without processes, so we move into a leaf of our own first.
+	 */
+	if (!strcmp(cgroup_base, UDRONE_CGROUP "/")) {
+		snprintf(cgroup_base, sizeof(cgroup_base), UDRONE_CGROUP "/" UDRONE_CGROUP_NAME);
+		if (mkdir(cgroup_base, 0755) && errno != EEXIST)
+			goto error;
+	}
+
+	/* Restarted from within our own leaf */
+	sep = strrchr(cgroup_base, '/');
+	if (!strcmp(sep, "/" UDRONE_CGROUP_SELF))
+		*sep = 0;
+
+	snprintf(path, sizeof(path), "%s/" UDRONE_CGROUP_SELF, cgroup_base);
+	if (mkdir(path, 0755) && errno != EEXIST)
+		goto error;
+
+	snprintf(path, sizeof(path), "%s/" UDRONE_CGROUP_SELF "/cgroup.procs", cgroup_base);
+	if (profile_write(path, "0"))
+		goto error;
+
+	snprintf(path, sizeof(path), "%s/cgroup.subtree_control", cgroup_base);
+	if (profile_write(path, "+cpu +memory"))
+		goto error;
+
+	for (p = profiles; p->name; p++) {
+		if (!p->cpu_max && !p->memory_max)
+			continue;
+
+		profile_cgroup_path(path, sizeof(path), p, NULL);
+		if (mkdir(path, 0755) && errno != EEXIST)
+			continue;
+
+		profile_cgroup_path(path, sizeof(path), p, "cpu.max");
+		if (p->cpu_max)
+			profile_write(path, p->cpu_max);
+
+		profile_cgroup_path(path, sizeof(path), p, "memory.max");
+		if (p->memory_max)
+			profile_write(path, p->memory_max);
+	}
+
+	cgroup_ok = true;
+	return;
+
+error:
+	syslog(LOG_INFO, "Cgroup %s not delegated, profiles will not limit resources",
+	       cgroup_base);
+}
+
+void
+udrone_profile_apply(const struct udrone_profile *p)
+{
+	char path[320];
+
+	if (!p)
+		return;
+
+	if (cgroup_ok && (p->cpu_max || p->memory_max)) {
+		profile_cgroup_path(path, sizeof(path), p, "cgroup.procs");
+		if (profile_write(path, "0"))
+			syslog(LOG_WARNING, "Unable to enter cgroup %s", path);
+	}
+
+	if (p->nice)
+		setpriority(PRIO_PROCESS, 0, p->nice);
+
+	if (p->ioprio_class)
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+			(p->ioprio_class << IOPRIO_CLASS_SHIFT) | p->ioprio);
+
+	if (p->cpus) {
+		cpu_set_t set;
+		int i;
+
+		CPU_ZERO(&set);
+		for (i = 0; i < sizeof(p->cpus) * 8; i++)
+			if (p->cpus & (1UL << i))
+				CPU_SET(i, &set);
+		sched_setaffinity(0, sizeof(set), &set);
+	}
+}
+
+void
+udrone_profile_usage(const struct udrone_profile *p)
+{
+	struct rusage self, children;
+	void *c;
+
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+
+	/* Includes processes spawned by the handler */
+	c = blobmsg_open_table(&udrone.out, "rusage");
+	if (p)
+		blobmsg_add_string(&udrone.out, "profile", p->name);
+	blobmsg_add_u32(&udrone.out, "utime",
+			(self.ru_utime.tv_sec + children.ru_utime.tv_sec) * 1000 +
+			(self.ru_utime.tv_usec + children.ru_utime.tv_usec) / 1000);
+	blobmsg_add_u32(&udrone.out, "stime",
+			(self.ru_stime.tv_sec + children.ru_stime.tv_sec) * 1000 +
+			(self.ru_stime.tv_usec + children.ru_stime.tv_usec) / 1000);
+	blobmsg_add_u32(&udrone.out, "maxrss",
+			self.ru_maxrss > children.ru_maxrss ? self.ru_maxrss : children.ru_maxrss);
+	blobmsg_close_table(&udrone.out, c);
+}
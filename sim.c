@@ -0,0 +1,550 @@
+/*
+ *   udrone - Multicast Device Remote Control
+ *   Copyright (C) 2019 John Crispin <blogic@openwrt.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "udrone.h"
+
+#define SIM_PREFIX	"sim"
+#define SIM_GROUPS	64
+#define SIM_SWEEP	1000
+
+enum {
+	SIM_GROUP_DEFAULT,
+	SIM_GROUP_LOST,
+};
+
+struct sim_reply {
+	struct sim_reply *next;
+	int64_t due;
+	int id;
+	struct sockaddr_in addr;
+	char to[32];
+	char *data;
+};
+
+/*
+ * Per drone state is kept in flat arrays so large farms stay small. Handlers
+ * are synthetic, so the code of the last reply is all a resend needs and a
+ * held command is remembered by the code it will reply with.
+ */
+static struct {
+	int count;
+	int latency;
+	int loss;
+	uint32_t *assigned;
+	int64_t *expires;
+	uint16_t *group;
+	uint8_t *busy;
+	uint8_t *code;
+	uint8_t *ahead;
+	uint8_t (*held)[UDRONE_SEQ_AHEAD];
+	struct sim_reply *head, **tail;
+	struct uloop_timeout reply;
+	struct uloop_timeout sweep;
+} sim;
+
+/* Assigned groups are released once the last drone left them */
+static struct {
+	char name[32];
+	uint32_t refs;
+} sim_groups[SIM_GROUPS] = {
+	[SIM_GROUP_DEFAULT] = { .name = UDRONE_GROUP_DEFAULT },
+	[SIM_GROUP_LOST] = { .name = UDRONE_GROUP_LOST },
+};
+
+static int64_t
+sim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool
+sim_lost(void)
+{
+	return sim.loss && (rand() % 100) < sim.loss;
+}
+
+/* Replies are built by the shared code, which signs with uniqueid */
+static void
+sim_self(int id)
+{
+	snprintf(udrone.uniqueid, sizeof(udrone.uniqueid), SIM_PREFIX "%09x", id);
+}
+
+static int
+sim_id(const char *to)
+{
+	unsigned long id;
+	char *end;
+
+	if (strncmp(to, SIM_PREFIX, strlen(SIM_PREFIX)))
+		return -1;
+
+	to += strlen(SIM_PREFIX);
+	id = strtoul(to, &end, 16);
+	if (end == to || *end || id >= sim.count)
+		return -1;
+
+	return id;
+}
+
+static bool
+sim_group_shared(int grp)
+{
+	struct in_addr a = udrone_group_addr(sim_groups[grp].name);
+	int i;
+
+	/* Several groups may hash onto the same address */
+	for (i = SIM_GROUP_LOST + 1; i < SIM_GROUPS; i++)
+		if (i != grp && sim_groups[i].refs &&
+		    udrone_group_addr(sim_groups[i].name).s_addr == a.s_addr)
+			return true;
+
+	return false;
+}
+
+static int
+sim_group_find(const char *grp)
+{
+	int i;
+
+	for (i = 0; i < SIM_GROUPS; i++)
+		if ((i <= SIM_GROUP_LOST || sim_groups[i].refs) &&
+		    !strcmp(sim_groups[i].name, grp))
+			return i;
+
+	return -1;
+}
+
+/* Group index, or a negative error code if the group can't be used */
+static int
+sim_group_add(const char *grp)
+{
+	int i = sim_group_find(grp);
+	int ret;
+
+	if (i >= 0)
+		return i;
+
+	for (i = SIM_GROUP_LOST + 1; i < SIM_GROUPS; i++) {
+		if (sim_groups[i].refs)
+			continue;
+
+		/* The socket's membership limit is usually hit first */
+		strcpy(sim_groups[i].name, grp);
+		if (!sim_group_shared(i)) {
+			ret = udrone_group_member(grp, true);
+			if (ret) {
+				sim_groups[i].name[0] = 0;
+				return -ret;
+			}
+		}
+		return i;
+	}
+
+	return -ENOSPC;
+}
+
+static void
+sim_group_set(int id, int grp)
+{
+	int old = sim.group[id];
+
+	if (old == grp)
+		return;
+
+	sim.group[id] = grp;
+	if (grp > SIM_GROUP_LOST)
+		sim_groups[grp].refs++;
+	if (old <= SIM_GROUP_LOST || --sim_groups[old].refs)
+		return;
+
+	if (!sim_group_shared(old))
+		udrone_group_member(sim_groups[old].name, false);
+}
+
+static void
+sim_expire(int id)
+{
+	sim.expires[id] = sim_now() + UDRONE_GROUP_TIMEOUT * 1000;
+}
+
+static void
+sim_reset(int id, int grp)
+{
+	sim_group_set(id, grp);
+	sim.assigned[id] = 0;
+	sim.ahead[id] = 0;
+	sim.code[id] = 0;
+	sim.expires[id] = 0;
+}
+
+static void
+sim_timeout(int id)
+{
+	sim_reset(id, SIM_GROUP_LOST);
+	sim_expire(id);
+}
+
+static void
+sim_send(struct sockaddr_in *addr)
+{
+	if (!sim_lost())
+		udrone_send(udrone.out.head, addr);
+}
+
+static void
+sim_queue(int id, const char *to, struct sockaddr_in *addr)
+{
+	struct sim_reply *r;
+
+	if (!sim.latency) {
+		sim_send(addr);
+		return;
+	}
+
+	if (sim_lost())
+		return;
+
+	/* The latency is fixed, so replies are due in queue order */
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return;
+	r->data = udrone_format(udrone.out.head);
+	if (!r->data) {
+		free(r);
+		return;
+	}
+	r->due = sim_now() + sim.latency;
+	r->id = id;
+	r->addr = *addr;
+	strncpy(r->to, to, sizeof(r->to) - 1);
+
+	if (!sim.head)
+		uloop_timeout_set(&sim.reply, sim.latency);
+	*sim.tail = r;
+	sim.tail = &r->next;
+	sim.busy[id]++;
+}
+
+/* Run held commands once the drone is idle, as a real drone does */
+static void
+sim_drain(int id, const char *to, struct sockaddr_in *addr)
+{
+	while ((sim.ahead[id] & 1) && !sim.busy[id]) {
+		sim.assigned[id]++;
+		sim.ahead[id] >>= 1;
+		sim.code[id] = sim.held[id][sim.assigned[id] % UDRONE_SEQ_AHEAD];
+
+		sim_self(id);
+		udrone_prepare_reply(to, sim.assigned[id], sim.code[id]);
+		sim_queue(id, to, addr);
+	}
+}
+
+static void
+sim_reply_cb(struct uloop_timeout *t)
+{
+	int64_t now = sim_now();
+	struct sim_reply *r;
+
+	while ((r = sim.head) && r->due <= now) {
+		sim.head = r->next;
+		if (!sim.head)
+			sim.tail = &sim.head;
+
+		sendto(udrone.sock.fd, r->data, strlen(r->data), 0,
+			(struct sockaddr*)&r->addr, sizeof(r->addr));
+		if (!--sim.busy[r->id])
+			sim_drain(r->id, r->to, &r->addr);
+		free(r->data);
+		free(r);
+	}
+
+	if (sim.head)
+		uloop_timeout_set(&sim.reply, sim.head->due - now);
+}
+
+static void
+sim_sweep(struct uloop_timeout *t)
+{
+	int64_t now = sim_now();
+	int i;
+
+	for (i = 0; i < sim.count; i++) {
+		if (!sim.expires[i] || sim.expires[i] > now)
+			continue;
+
+		if (sim.group[i] == SIM_GROUP_LOST)
+			sim_reset(i, SIM_GROUP_DEFAULT);
+		else
+			sim_timeout(i);
+	}
+
+	uloop_timeout_set(t, SIM_SWEEP);
+}
+
+/* Synthetic result of a command, no handler runs on the host */
+static int
+sim_code(struct blob_attr **msg)
+{
+	struct udrone_registry *reg = udrone_lookup(blobmsg_get_string(msg[MSG_TYPE]));
+
+	if (!reg || !reg->handler)
+		return ENOTSUP;
+	if (udrone_flags(reg, msg) & UDRONE_HANDLER_MIXED)
+		return EINVAL;
+	if (msg[MSG_AT] || msg[MSG_DELAY])
+		return ENOTSUP;
+
+	return 0;
+}
+
+/* Worker and deferred commands are accepted before they reply */
+static bool
+sim_accepted(struct blob_attr **msg)
+{
+	struct udrone_registry *reg = udrone_lookup(blobmsg_get_string(msg[MSG_TYPE]));
+
+	return !(udrone_flags(reg, msg) & UDRONE_HANDLER_ATOMIC) ||
+		(reg->flags & UDRONE_HANDLER_DEFERRED);
+}
+
+static int
+sim_msg_ctrl(int id, struct blob_attr **msg)
+{
+	char *type = blobmsg_get_string(msg[MSG_TYPE]);
+	struct blob_attr *seq;
+	char *name;
+	int grp, ret;
+
+	if (!strcmp(type, "!whois"))
+		return udrone_parse_whois(msg);
+
+	if (!strcmp(type, "!assign")) {
+		ret = udrone_parse_assign(msg, &name, &seq);
+		if (ret)
+			return ret;
+
+		grp = sim_group_add(name);
+		if (grp < 0)
+			return -grp;
+
+		sim_group_set(id, grp);
+
+		/* Held commands belong to the old sequence */
+		if (seq && blobmsg_get_u32(seq) != sim.assigned[id]) {
+			sim.ahead[id] = 0;
+			sim.assigned[id] = blobmsg_get_u32(seq);
+		}
+
+		sim_expire(id);
+		return 0;
+	}
+
+	if (!strcmp(type, "!reset")) {
+		sim_reset(id, SIM_GROUP_DEFAULT);
+		return 0;
+	}
+
+	return -ENOTSUP;
+}
+
+static void
+sim_hold(int id, struct blob_attr **tb)
+{
+	uint32_t seq = blobmsg_get_u32(tb[MSG_SEQ]);
+
+	sim.ahead[id] |= 1 << (seq - sim.assigned[id] - 1);
+	sim.held[id][seq % UDRONE_SEQ_AHEAD] = sim_code(tb);
+	udrone_prepare_gap(tb, sim.assigned[id], sim.ahead[id]);
+}
+
+static void
+sim_run(int id, struct blob_attr **tb, struct sockaddr_in *addr)
+{
+	char *from = blobmsg_get_string(tb[MSG_FROM]);
+	int code = sim_code(tb);
+
+	if (!code && sim_accepted(tb)) {
+		udrone_prepare(tb, "accept");
+		sim_send(addr);
+	}
+
+	/* A held copy of the same command is obsolete now */
+	sim.ahead[id] >>= 1;
+	sim.assigned[id]++;
+	sim.code[id] = code;
+	sim_expire(id);
+
+	udrone_prepare_status(tb, code);
+	sim_queue(id, from, addr);
+	sim_drain(id, from, addr);
+}
+
+/* Same decisions as udrone_dispatch() for a single channel */
+static void
+sim_msg(int id, struct blob_attr **tb, struct sockaddr_in *addr)
+{
+	char *type = blobmsg_get_string(tb[MSG_TYPE]);
+	int ret;
+
+	if (sim_lost())
+		return;
+
+	sim_self(id);
+	if (type[0] == '!') {
+		ret = sim_msg_ctrl(id, tb);
+		if (ret < 0)
+			return;
+		udrone_prepare_ctrl(tb, ret);
+		if (sim.assigned[id])
+			sim_expire(id);
+		sim_send(addr);
+		return;
+	}
+
+	switch (udrone_seq_check(sim.assigned[id], blobmsg_get_u32(tb[MSG_SEQ]))) {
+	case UDRONE_SEQ_RESEND:
+		sim_expire(id);
+		if (sim.busy[id])
+			udrone_prepare(tb, "accept");
+		else
+			udrone_prepare_status(tb, sim.code[id]);
+		break;
+	case UDRONE_SEQ_DUP:
+		udrone_prepare_status(tb, EALREADY);
+		break;
+	case UDRONE_SEQ_HOLD:
+		sim_hold(id, tb);
+		sim_expire(id);
+		break;
+	case UDRONE_SEQ_LOST:
+		udrone_prepare_status(tb, ESRCH);
+		sim_timeout(id);
+		break;
+	default:
+		if (!sim.busy[id]) {
+			sim_run(id, tb, addr);
+			return;
+		}
+		udrone_prepare_status(tb, EBUSY);
+		break;
+	}
+
+	sim_send(addr);
+}
+
+/* An "!assign" that changes neither group nor sequence ID of any drone it reaches */
+bool
+udrone_sim_renewal(struct blob_attr **tb)
+{
+	char *to = blobmsg_get_string(tb[MSG_TO]);
+	struct blob_attr *seq;
+	char *name;
+	int id, grp, i;
+
+	if (strcmp(blobmsg_get_string(tb[MSG_TYPE]), "!assign") ||
+	    udrone_parse_assign(tb, &name, &seq) || !seq)
+		return false;
+
+	grp = sim_group_find(name);
+	if (grp < 0)
+		return false;
+
+	id = sim_id(to);
+	if (id >= 0)
+		return sim.group[id] == grp && sim.assigned[id] == blobmsg_get_u32(seq);
+
+	if (sim_group_find(to) != grp)
+		return false;
+
+	for (i = 0; i < sim.count; i++)
+		if (sim.group[i] == grp && sim.assigned[i] != blobmsg_get_u32(seq))
+			return false;
+
+	return true;
+}
+
+void
+udrone_sim_dispatch(struct blob_attr **tb, struct sockaddr_in *sender)
+{
+	char *to = blobmsg_get_string(tb[MSG_TO]);
+	int id, grp, i;
+
+	clock_gettime(CLOCK_REALTIME, &udrone.dispatch_ts);
+
+	id = sim_id(to);
+	if (id >= 0) {
+		sim_msg(id, tb, sender);
+		return;
+	}
+
+	grp = sim_group_find(to);
+	if (grp < 0)
+		return;
+
+	for (i = 0; i < sim.count; i++)
+		if (sim.group[i] == grp)
+			sim_msg(i, tb, sender);
+}
+
+int
+udrone_sim_init(int count, int latency, int loss)
+{
+	sim.assigned = calloc(count, sizeof(*sim.assigned));
+	sim.expires = calloc(count, sizeof(*sim.expires));
+	sim.group = calloc(count, sizeof(*sim.group));
+	sim.busy = calloc(count, sizeof(*sim.busy));
+	sim.code = calloc(count, sizeof(*sim.code));
+	sim.ahead = calloc(count, sizeof(*sim.ahead));
+	sim.held = calloc(count, sizeof(*sim.held));
+	if (!sim.assigned || !sim.expires || !sim.group || !sim.busy ||
+	    !sim.code || !sim.ahead || !sim.held) {
+		syslog(LOG_ERR, "Failed to allocate %d virtual drones", count);
+		return -1;
+	}
+
+	sim.count = count;
+	sim.latency = latency;
+	sim.loss = loss;
+	sim.tail = &sim.head;
+	sim.reply.cb = sim_reply_cb;
+	sim.sweep.cb = sim_sweep;
+	uloop_timeout_set(&sim.sweep, SIM_SWEEP);
+	srand(getpid());
+
+	/* All virtual drones share the socket and receive path of the real one */
+	udrone.sim = count;
+	syslog(LOG_INFO, "Simulating %d drones with ids " SIM_PREFIX "%09x-" SIM_PREFIX "%09x",
+		count, 0, count - 1);
+
+	return 0;
+}
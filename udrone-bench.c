@@ -0,0 +1,330 @@
+/*
+ *   udrone - Multicast Device Remote Control
+ *   Copyright (C) 2019 John Crispin <blogic@openwrt.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "udrone.h"
+
+#define BENCH_ID	"0123456789ab"
+#define BENCH_MAX	64
+
+enum {
+	STAGE_PARSE = 0,
+	STAGE_DISPATCH,
+	STAGE_FORMAT,
+	__STAGE_MAX
+};
+
+static const char *stage_name[__STAGE_MAX] = {
+	[STAGE_PARSE] = "parse",
+	[STAGE_DISPATCH] = "dispatch",
+	[STAGE_FORMAT] = "format",
+};
+
+struct bench_msg {
+	char *data;
+	size_t len;
+	uint64_t ns[__STAGE_MAX];
+	uint64_t allocs[__STAGE_MAX];
+	int failed;
+	int code;
+};
+
+enum {
+	REPLY_TYPE = 0,
+	REPLY_DATA,
+	__REPLY_MAX
+};
+
+static const struct blobmsg_policy reply_policy[__REPLY_MAX] = {
+	[REPLY_TYPE] = { .name = "type", .type = BLOBMSG_TYPE_STRING },
+	[REPLY_DATA] = { .name = "data", .type = BLOBMSG_TYPE_TABLE },
+};
+
+static const struct blobmsg_policy code_policy = {
+	.name = "code", .type = BLOBMSG_TYPE_INT32,
+};
+
+/*
+ * Recorded with a master driving a drone assigned to group "bench". Without
+ * /etc/config/network or a ubus daemon, uci_get and ubus only measure their
+ * error path, the report flags such rows.
+ */
+static const char *corpus_default[] = {
+	"{\"to\":\"!all-default\",\"from\":\"bench\",\"seq\":0,\"type\":\"!whois\",\"data\":{\"board\":\"generic\"}}",
+	"{\"to\":\"" BENCH_ID "\",\"from\":\"bench\",\"seq\":0,\"type\":\"!assign\",\"data\":{\"group\":\"bench\",\"seq\":1}}",
+	"{\"to\":\"bench\",\"from\":\"bench\",\"seq\":2,\"type\":\"sysinfo\"}",
+	"{\"to\":\"bench\",\"from\":\"bench\",\"seq\":3,\"type\":\"uci_get\",\"data\":{\"config\":\"network\",\"type\":\"interface\"}}",
+	"{\"to\":\"bench\",\"from\":\"bench\",\"seq\":4,\"type\":\"ubus\",\"data\":{\"path\":\"system\",\"method\":\"board\"}}",
+	NULL
+};
+
+static struct bench_msg corpus[BENCH_MAX];
+static int corpus_len;
+static uint64_t allocs;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *
+malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+bench_add(const char *data)
+{
+	struct bench_msg *m;
+
+	if (corpus_len >= BENCH_MAX || *data != '{')
+		return;
+
+	m = &corpus[corpus_len++];
+	m->data = strdup(data);
+	m->len = strlen(data);
+}
+
+static int
+bench_load(const char *path)
+{
+	char line[UDRONE_MAX_DGRAM];
+	FILE *fp = fopen(path, "r");
+
+	if (!fp)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\r\n")] = 0;
+		bench_add(line);
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+static int
+bench_code(struct blob_attr *reply)
+{
+	struct blob_attr *tb[__REPLY_MAX], *code;
+
+	blobmsg_parse(reply_policy, __REPLY_MAX, tb, blob_data(reply), blob_len(reply));
+	if (!tb[REPLY_TYPE] || strcmp(blobmsg_get_string(tb[REPLY_TYPE]), "status") ||
+	    !tb[REPLY_DATA])
+		return 0;
+
+	blobmsg_parse(&code_policy, 1, &code, blobmsg_data(tb[REPLY_DATA]), blobmsg_len(tb[REPLY_DATA]));
+
+	return code ? blobmsg_get_u32(code) : 0;
+}
+
+static void
+bench_run(struct bench_msg *m)
+{
+	struct sockaddr_in sender = {
+		.sin_family = AF_INET,
+		.sin_addr = { htonl(INADDR_LOOPBACK) },
+		.sin_port = htons(UDRONE_PORT),
+	};
+	struct blob_attr *tb[__MSG_MAX] = { 0 };
+	struct blob_attr *reply;
+	uint64_t t, a;
+	char *buf;
+
+	t = bench_now();
+	a = allocs;
+	if (udrone_parse(tb, m->data, m->len) <= 0) {
+		m->failed++;
+		return;
+	}
+	m->ns[STAGE_PARSE] += bench_now() - t;
+	m->allocs[STAGE_PARSE] += allocs - a;
+
+	/* Replay commands in sequence on the bench channel */
+	if (*blobmsg_get_string(tb[MSG_TYPE]) != '!' && tb[MSG_SEQ])
+		udrone.chan[0].assigned = blobmsg_get_u32(tb[MSG_SEQ]) - 1;
+
+	t = bench_now();
+	a = allocs;
+	reply = udrone_dispatch(tb, &sender);
+	m->ns[STAGE_DISPATCH] += bench_now() - t;
+	m->allocs[STAGE_DISPATCH] += allocs - a;
+	if (!reply) {
+		m->failed++;
+		return;
+	}
+
+	t = bench_now();
+	a = allocs;
+	buf = udrone_format(reply);
+	m->ns[STAGE_FORMAT] += bench_now() - t;
+	m->allocs[STAGE_FORMAT] += allocs - a;
+	free(buf);
+
+	m->code = bench_code(reply);
+}
+
+static void
+bench_report(int rounds)
+{
+	bool errors = false;
+	int i, j;
+
+	printf("%-24s", "message");
+	for (j = 0; j < __STAGE_MAX; j++)
+		printf(" %10s/ns %8s/alloc", stage_name[j], stage_name[j]);
+	printf(" %8s %s\n", "failed", "result");
+
+	for (i = 0; i < corpus_len; i++) {
+		struct bench_msg *m = &corpus[i];
+		struct blob_attr *tb[__MSG_MAX] = { 0 };
+		char name[25] = "?";
+
+		if (udrone_parse(tb, m->data, m->len) > 0)
+			snprintf(name, sizeof(name), "%d:%s", i, blobmsg_get_string(tb[MSG_TYPE]));
+
+		printf("%-24s", name);
+		for (j = 0; j < __STAGE_MAX; j++)
+			printf(" %13llu %14.1f",
+			       (unsigned long long) (m->ns[j] / rounds),
+			       (double) m->allocs[j] / rounds);
+		printf(" %8d", m->failed);
+
+		/* Error replies do not exercise the handler, do not compare them */
+		if (m->code) {
+			printf(" error path (%s)\n", strerror(m->code));
+			errors = true;
+		} else {
+			printf(" ok\n");
+		}
+	}
+
+	if (errors)
+		printf("\nRows marked \"error path\" only time the failure reply of the handler.\n");
+}
+
+static int
+usage(const char *prog)
+{
+	fprintf(stderr, "udrone-bench - udrone message pipeline benchmark\n\n"
+		"Usage: %s [options] [corpus]\n"
+		"Options:\n"
+		"\t-n <rounds>\tReplay the corpus this many times (default 10000)\n\n"
+		"The corpus holds one JSON datagram per line. Commands are expected\n"
+		"to use atomic handlers and to be addressed to the group \"bench\".\n",
+		prog);
+	return EXIT_FAILURE;
+}
+
+int
+main(int argc, char **argv)
+{
+	int rounds = 10000;
+	int ch, i, j;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+		default:
+			return usage(*argv);
+		}
+	}
+
+	if (rounds <= 0)
+		return usage(*argv);
+
+	if (optind < argc) {
+		if (bench_load(argv[optind])) {
+			fprintf(stderr, "Unable to read corpus %s\n", argv[optind]);
+			return EXIT_FAILURE;
+		}
+	} else {
+		for (i = 0; corpus_default[i]; i++)
+			bench_add(corpus_default[i]);
+	}
+
+	/* No socket, no ubus connection and no per-group addresses */
+	udrone.sock.fd = -1;
+	udrone.ubus.ctx.sock.fd = -1;
+	strncpy(udrone.uniqueid, BENCH_ID, sizeof(udrone.uniqueid) - 1);
+	strncpy(udrone.board, "generic", sizeof(udrone.board) - 1);
+	udrone.ifname = "lo";
+
+	uloop_init();
+	if (udrone_init())
+		return EXIT_FAILURE;
+
+	/* Warm up caches and buffers before measuring */
+	for (i = 0; i < corpus_len; i++)
+		bench_run(&corpus[i]);
+	for (i = 0; i < corpus_len; i++) {
+		memset(corpus[i].ns, 0, sizeof(corpus[i].ns));
+		memset(corpus[i].allocs, 0, sizeof(corpus[i].allocs));
+		corpus[i].failed = 0;
+	}
+
+	for (j = 0; j < rounds; j++)
+		for (i = 0; i < corpus_len; i++)
+			bench_run(&corpus[i]);
+
+	bench_report(rounds);
+
+	udrone_done();
+	uloop_done();
+
+	for (i = 0; i < corpus_len; i++)
+		free(corpus[i].data);
+
+	return 0;
+}
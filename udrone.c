@@ -33,6 +33,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+#include <linux/net_tstamp.h>
 
 #include "udrone.h"
 
@@ -42,6 +44,10 @@ static const struct blobmsg_policy msg_policy[__MSG_MAX] = {
 	[MSG_SEQ] = { .name = "seq", .type = BLOBMSG_TYPE_INT32 },
 	[MSG_TYPE] = { .name = "type", .type = BLOBMSG_TYPE_STRING },
 	[MSG_DATA] = { .name = "data", .type = BLOBMSG_TYPE_UNSPEC },
+	[MSG_PROFILE] = { .name = "profile", .type = BLOBMSG_TYPE_STRING },
+	[MSG_TIMING] = { .name = "timing", .type = BLOBMSG_TYPE_BOOL },
+	[MSG_AT] = { .name = "at", .type = BLOBMSG_TYPE_UNSPEC },
+	[MSG_DELAY] = { .name = "delay", .type = BLOBMSG_TYPE_UNSPEC },
 };
 
 enum {
@@ -64,46 +70,267 @@ static const struct blobmsg_policy assign_policy[__ASSIGN_MAX] = {
 	[ASSIGN_SEQ] = { .name = "seq", .type = BLOBMSG_TYPE_INT32 },
 };
 
-static struct sockaddr_in addr = {
-	.sin_addr = {INADDR_ANY},
-	.sin_family = AF_INET
+enum {
+	BATCH_CMDS = 0,
+	BATCH_CONTINUE,
+	__BATCH_MAX
+};
+
+static const struct blobmsg_policy batch_policy[__BATCH_MAX] = {
+	[BATCH_CMDS] = { .name = "cmds", .type = BLOBMSG_TYPE_ARRAY },
+	[BATCH_CONTINUE] = { .name = "continue", .type = BLOBMSG_TYPE_BOOL },
+};
+
+enum {
+	BATCH_CMD_TYPE = 0,
+	BATCH_CMD_DATA,
+	__BATCH_CMD_MAX
+};
+
+static const struct blobmsg_policy batch_cmd_policy[__BATCH_CMD_MAX] = {
+	[BATCH_CMD_TYPE] = { .name = "type", .type = BLOBMSG_TYPE_STRING },
+	[BATCH_CMD_DATA] = { .name = "data", .type = BLOBMSG_TYPE_UNSPEC },
 };
 
+struct udrone_dgram {
+	struct sockaddr_in addr;
+	struct timespec ts;
+	size_t len;
+	bool ctrl;
+	bool early;
+	bool parsed;
+	struct udrone_channel *chan;
+	char data[UDRONE_MAX_DGRAM];
+};
+
+/* Layout of the SCM_TIMESTAMPING control message */
+struct udrone_tstamp {
+	struct timespec ts[3];
+};
+
+static struct in_addr group_base;
+static char *worker_buf;
+static struct udrone_channel *defer_chan;
+static struct udrone_dgram *rx_queue;
+static int64_t renew_delay_max;
+
 struct udrone_ctx udrone = { 0 };
 static struct udrone_module *modules = NULL;
 
+uint32_t
+udrone_hash(const void *data, size_t len, uint32_t hash)
+{
+	const uint8_t *p = data;
+
+	/* FNV-1a, masters derive the group addresses using the same function */
+	while (len--) {
+		hash ^= *p++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+struct in_addr
+udrone_group_addr(const char *grp)
+{
+	struct in_addr a = group_base;
+
+	/* Predefined groups share the base address with the control traffic */
+	if (grp[0] != '!' && udrone.group_mask)
+		a.s_addr = htonl(ntohl(udrone.group_net.s_addr) |
+			(udrone_hash(grp, strlen(grp), UDRONE_HASH_INIT) & udrone.group_mask));
+
+	return a;
+}
+
+static int
+udrone_mcast(int op, struct in_addr group)
+{
+	struct ip_mreqn imr = {
+		.imr_multiaddr = group,
+		.imr_address = {INADDR_ANY},
+		.imr_ifindex = udrone.ifindex,
+	};
+
+	return setsockopt(udrone.sock.fd, SOL_IP, op, &imr, sizeof(imr));
+}
+
+/* Join or leave the derived address of a group without tracking it on a channel */
+int
+udrone_group_member(const char *grp, bool join)
+{
+	struct in_addr a = udrone_group_addr(grp);
+	int ret;
+
+	if (a.s_addr == group_base.s_addr)
+		return 0;
+
+	if (!udrone_mcast(join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP, a) || !join)
+		return 0;
+
+	ret = errno;
+	syslog(LOG_WARNING, "Failed to join group address %s: %s",
+		inet_ntoa(a), strerror(ret));
+	return ret;
+}
+
+static bool
+udrone_group_used(struct udrone_channel *chan, struct in_addr a)
+{
+	int i;
+
+	for (i = 0; i < UDRONE_MAX_CHANNELS; i++)
+		if (&udrone.chan[i] != chan && udrone.chan[i].group_addr.s_addr == a.s_addr)
+			return true;
+
+	return false;
+}
+
+static int
+udrone_group_join(struct udrone_channel *chan)
+{
+	struct in_addr a = udrone_group_addr(chan->group);
+	struct in_addr old = chan->group_addr;
+	int ret;
+
+	if (a.s_addr == old.s_addr)
+		return 0;
+
+	/* Several channels may hash onto the same address */
+	chan->group_addr = a;
+	if (old.s_addr != group_base.s_addr && !udrone_group_used(chan, old))
+		udrone_mcast(IP_DROP_MEMBERSHIP, old);
+	if (a.s_addr != group_base.s_addr && !udrone_group_used(chan, a) &&
+	    udrone_mcast(IP_ADD_MEMBERSHIP, a)) {
+		ret = errno;
+		syslog(LOG_WARNING, "Failed to join group address %s: %s",
+			inet_ntoa(a), strerror(ret));
+		chan->group_addr = group_base;
+		return ret;
+	}
+
+	return 0;
+}
+
+static bool
+udrone_busy(struct udrone_channel *chan)
+{
+	return chan->worker.pending || chan->sched.pending || chan->req;
+}
+
 static void
-udrone_reset(char *grp)
+udrone_seq_flush(struct udrone_channel *chan)
 {
-	uloop_timeout_cancel(&udrone.timeout);
-	udrone.assigned = 0;
-	memset(udrone.group, 0, sizeof(udrone.group));
-	strcpy(udrone.group, grp);
-	if (udrone.worker.pending) {
-		uloop_process_delete(&udrone.worker);
-		kill(udrone.worker.pid, SIGTERM);
+	int i;
+
+	uloop_timeout_cancel(&chan->drain);
+	for (i = 0; i < UDRONE_SEQ_AHEAD; i++) {
+		free(chan->ahead[i].msg);
+		chan->ahead[i].msg = NULL;
+	}
+	chan->ahead_mask = 0;
+}
+
+/* Run the next held command from the loop once the channel is idle */
+static void
+udrone_seq_kick(struct udrone_channel *chan)
+{
+	if ((chan->ahead_mask & 1) && !udrone_busy(chan))
+		uloop_timeout_set(&chan->drain, 0);
+}
+
+static void
+udrone_request_free(struct udrone_request *req, bool cancel)
+{
+	uloop_timeout_cancel(&req->timeout);
+	req->chan->req = NULL;
+	if (cancel && req->cancel)
+		req->cancel(req);
+	free(req);
+}
+
+static void
+udrone_reset(struct udrone_channel *chan, char *grp)
+{
+	struct udrone_module *m;
+
+	if (chan->req)
+		udrone_request_free(chan->req, true);
+	udrone_seq_flush(chan);
+
+	for (m = modules; m; m = m->next)
+		if (m->reset)
+			m->reset(chan);
+
+	uloop_timeout_cancel(&chan->timeout);
+	chan->assigned = 0;
+	memset(chan->group, 0, sizeof(chan->group));
+	strcpy(chan->group, grp);
+	if (!strcmp(grp, UDRONE_GROUP_DEFAULT))
+		memset(chan->master, 0, sizeof(chan->master));
+	free(chan->reply);
+	chan->reply = NULL;
+	udrone_group_join(chan);
+	uloop_timeout_cancel(&chan->sched);
+	free(chan->sched_msg);
+	chan->sched_msg = NULL;
+	if (chan->sched_fd >= 0) {
+		close(chan->sched_fd);
+		chan->sched_fd = -1;
+	}
+	if (chan->worker.pending) {
+		uloop_process_delete(&chan->worker);
+		kill(chan->worker.pid, SIGTERM);
 	}
 }
 
 static void
 udrone_timeout_default(struct uloop_timeout *t)
 {
-        udrone_reset(UDRONE_GROUP_DEFAULT);
+	udrone_reset(container_of(t, struct udrone_channel, timeout), UDRONE_GROUP_DEFAULT);
 }
 
 static void
 udrone_timeout(struct uloop_timeout *t)
 {
-	udrone.timeout.cb = udrone_timeout_default;
-	udrone_reset(UDRONE_GROUP_LOST);
-	uloop_timeout_set(&udrone.timeout, UDRONE_GROUP_TIMEOUT * 1000);
+	struct udrone_channel *chan = container_of(t, struct udrone_channel, timeout);
+
+	chan->timeout.cb = udrone_timeout_default;
+	udrone_reset(chan, UDRONE_GROUP_LOST);
+	uloop_timeout_set(&chan->timeout, UDRONE_GROUP_TIMEOUT * 1000);
 }
 
 static void
-udrone_reset_timer(void)
+udrone_reset_timer(struct udrone_channel *chan)
 {
-	udrone.timeout.cb = udrone_timeout;
-	uloop_timeout_set(&udrone.timeout, UDRONE_GROUP_TIMEOUT * 1000);
+	chan->timeout.cb = udrone_timeout;
+	uloop_timeout_set(&chan->timeout, UDRONE_GROUP_TIMEOUT * 1000);
+}
+
+static struct udrone_channel *
+udrone_channel_find(const char *to, const char *from)
+{
+	struct udrone_channel *chan, *idle = NULL;
+	int i;
+
+	for (i = 0; i < UDRONE_MAX_CHANNELS; i++) {
+		chan = &udrone.chan[i];
+
+		if (!strcmp(to, chan->group))
+			return chan;
+
+		if (strcmp(to, udrone.uniqueid))
+			continue;
+
+		/* Unicast belongs to the channel the sender is driving */
+		if (!strcmp(from, chan->master))
+			return chan;
+		if (!idle && !strcmp(chan->group, UDRONE_GROUP_DEFAULT))
+			idle = chan;
+	}
+
+	return idle;
 }
 
 void
@@ -113,35 +340,81 @@ udrone_register(struct udrone_module *module)
 	modules = module;
 }
 
+void
+udrone_connect(void)
+{
+	struct udrone_module *m;
+
+	for (m = modules; m; m = m->next)
+		if (m->connect)
+			m->connect();
+}
+
+static int64_t
+udrone_ts_us(struct timespec *from, struct timespec *to)
+{
+	return (int64_t) (to->tv_sec - from->tv_sec) * 1000000 +
+		(to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static void
+udrone_prepare_to(struct blob_buf *b, const char *to, uint32_t seq, char *type)
+{
+	blob_buf_init(b, 0);
+	blobmsg_add_string(b, "to", to);
+	blobmsg_add_string(b, "from", udrone.uniqueid);
+	blobmsg_add_u32(b, "seq", seq);
+	blobmsg_add_string(b, "type", type);
+}
+
 void
 udrone_prepare(struct blob_attr **tb, char *type)
+{
+	udrone_prepare_to(&udrone.out, blobmsg_get_string(tb[MSG_FROM]), blobmsg_get_u32(tb[MSG_SEQ]), type);
+}
+
+void
+udrone_prepare_notice(struct udrone_channel *chan, char *type)
 {
 	blob_buf_init(&udrone.out, 0);
-	blobmsg_add_string(&udrone.out, "to", blobmsg_get_string(tb[MSG_FROM]));
+	blobmsg_add_string(&udrone.out, "to", chan->master);
 	blobmsg_add_string(&udrone.out, "from", udrone.uniqueid);
-	blobmsg_add_u32(&udrone.out, "seq", blobmsg_get_u32(tb[MSG_SEQ]));
+	blobmsg_add_u32(&udrone.out, "seq", 0);
 	blobmsg_add_string(&udrone.out, "type", type);
 }
 
 static void
-udrone_prepare_status(struct blob_attr **tb, int code)
+udrone_add_status(struct blob_buf *b, int code)
 {
 	void *c;
 
-	udrone_prepare(tb, "status");
-
 	if (code >= 0) {
-		c = blobmsg_open_table(&udrone.out, "data");
-		blobmsg_add_u32(&udrone.out, "code", code);
+		c = blobmsg_open_table(b, "data");
+		blobmsg_add_u32(b, "code", code);
 		if (code)
-			blobmsg_add_string(&udrone.out, "errstr", strerror(code));
-		blobmsg_close_table(&udrone.out, c);
+			blobmsg_add_string(b, "errstr", strerror(code));
+		blobmsg_close_table(b, c);
 	}
 }
 
-static void
+void
+udrone_prepare_status(struct blob_attr **tb, int code)
+{
+	udrone_prepare(tb, "status");
+	udrone_add_status(&udrone.out, code);
+}
+
+void
+udrone_prepare_reply(const char *to, uint32_t seq, int code)
+{
+	udrone_prepare_to(&udrone.out, to, seq, "status");
+	udrone_add_status(&udrone.out, code);
+}
+
+void
 udrone_prepare_ctrl(struct blob_attr **tb, int code)
 {
+	int64_t delay;
 	void *c;
 
 	udrone_prepare(tb, "status");
@@ -152,6 +425,15 @@ udrone_prepare_ctrl(struct blob_attr **tb, int code)
 		blobmsg_add_u32(&udrone.out, "code", code);
 		if (code)
 			blobmsg_add_string(&udrone.out, "errstr", strerror(code));
+
+		/* Renewals report how long they waited behind other traffic */
+		if (!strcmp(blobmsg_get_string(tb[MSG_TYPE]), "!assign")) {
+			delay = udrone_ts_us(&udrone.rx_ts, &udrone.dispatch_ts);
+			if (delay > renew_delay_max)
+				renew_delay_max = delay;
+			blobmsg_add_u64(&udrone.out, "delay_us", delay);
+			blobmsg_add_u64(&udrone.out, "max_delay_us", renew_delay_max);
+		}
 		blobmsg_close_table(&udrone.out, c);
 	}
 }
@@ -162,144 +444,578 @@ udrone_prepare_accept(struct blob_attr **tb)
 	udrone_prepare(tb, "accept");
 }
 
+static bool
+udrone_timing(struct blob_attr **tb)
+{
+	return tb[MSG_TIMING] && blobmsg_get_bool(tb[MSG_TIMING]);
+}
+
 static void
-udrone_send(struct sockaddr_in addr)
+udrone_put_timing(struct blob_buf *b, struct timespec *rx, struct timespec *dispatch)
 {
-	char *buf = blobmsg_format_json(udrone.out.head, 1);
+	struct timespec now;
+	void *c;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	c = blobmsg_open_table(b, "timing");
+	blobmsg_add_u64(b, "queue_us", udrone_ts_us(rx, dispatch));
+	blobmsg_add_u64(b, "dispatch_us", udrone_ts_us(dispatch, &now));
+	blobmsg_close_table(b, c);
+}
+
+static void
+udrone_add_timing(struct blob_attr **tb)
+{
+	if (udrone_timing(tb))
+		udrone_put_timing(&udrone.out, &udrone.rx_ts, &udrone.dispatch_ts);
+}
+
+char *
+udrone_format(struct blob_attr *msg)
+{
+	return blobmsg_format_json(msg, true);
+}
+
+void
+udrone_send(struct blob_attr *msg, struct sockaddr_in *addr)
+{
+	char *buf = udrone_format(msg);
+
+	if (!buf)
+		return;
 
 	fprintf(stderr, "send\t%s\n", buf);
 	sendto(udrone.sock.fd, buf, strlen(buf), 0,
-		(struct sockaddr*)&addr, sizeof(addr));
+		(struct sockaddr*)addr, sizeof(*addr));
 	free(buf);
 }
 
 static void
 udrone_worker_cb(struct uloop_process *c, int ret)
 {
-	fprintf(stderr, "send\t%s\n", udrone.worker_buf);
-	sendto(udrone.sock.fd, udrone.worker_buf, strlen(udrone.worker_buf), 0,
-		(struct sockaddr*)&udrone.worker_addr, sizeof(udrone.worker_addr));
+	struct udrone_channel *chan = container_of(c, struct udrone_channel, worker);
+
+	free(chan->reply);
+	chan->reply = blob_memdup((struct blob_attr *) chan->worker_buf);
+	udrone_send(chan->reply, &chan->addr);
+	udrone_seq_kick(chan);
 }
 
 static void
-udrone_msg_cmd(struct blob_attr **msg)
+udrone_request_timeout(struct uloop_timeout *t)
 {
-	struct udrone_registry *reg = NULL;
-	struct udrone_module *m;
-	char *type = blobmsg_get_string(msg[MSG_TYPE]);
-	int stat;
+	struct udrone_request *req = container_of(t, struct udrone_request, timeout);
+
+	if (req->cancel)
+		req->cancel(req);
+	req->cancel = NULL;
+	udrone_request_complete(req, -ETIMEDOUT, NULL);
+}
+
+struct udrone_request *
+udrone_defer(struct blob_attr **msg, int timeout)
+{
+	struct udrone_channel *chan = udrone.cur;
+	struct udrone_request *req;
+
+	/* Batches, workers, schedules and virtual drones complete in place */
+	if (!chan || chan != defer_chan || chan->req)
+		return NULL;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return NULL;
+
+	req->chan = chan;
+	req->addr = chan->addr;
+	strncpy(req->to, blobmsg_get_string(msg[MSG_FROM]), sizeof(req->to) - 1);
+	strncpy(req->type, blobmsg_get_string(msg[MSG_TYPE]), sizeof(req->type) - 1);
+	req->seq = blobmsg_get_u32(msg[MSG_SEQ]);
+	req->timing = udrone_timing(msg);
+	req->rx_ts = udrone.rx_ts;
+	req->dispatch_ts = udrone.dispatch_ts;
+	req->timeout.cb = udrone_request_timeout;
+	uloop_timeout_set(&req->timeout, timeout);
+	chan->req = req;
+
+	return req;
+}
+
+void
+udrone_request_complete(struct udrone_request *req, int stat, struct blob_attr *data)
+{
+	/* May run inside a nested ubus call while udrone.out is half built */
+	static struct blob_buf b;
+	struct udrone_channel *chan = req->chan;
+	struct blob_attr *cur;
 	void *c;
+	int rem;
+
+	if (stat > 0) {
+		udrone_prepare_to(&b, req->to, req->seq, req->type);
+		c = blobmsg_open_table(&b, "data");
+		if (data)
+			blobmsg_for_each_attr(cur, data, rem)
+				blobmsg_add_blob(&b, cur);
+		blobmsg_close_table(&b, c);
+	} else {
+		udrone_prepare_to(&b, req->to, req->seq, "status");
+		udrone_add_status(&b, -stat);
+	}
+
+	/* The time until the I/O completed is what the host asked for */
+	if (req->timing)
+		udrone_put_timing(&b, &req->rx_ts, &req->dispatch_ts);
+
+	/* Resends of the sequence ID get the final reply from now on */
+	free(chan->reply);
+	chan->reply = blob_memdup(b.head);
+	udrone_send(chan->reply, &req->addr);
+	udrone_request_free(req, false);
+	udrone_seq_kick(chan);
+}
+
+struct udrone_registry *
+udrone_lookup(const char *type)
+{
+	struct udrone_module *m;
 
-	for (m = modules; !reg && m; m = m->next) {
+	for (m = modules; m; m = m->next) {
 		struct udrone_registry *r;
 
-		for (r = m->registry; r->handler; r++) {
-			if (!strcmp(r->type, type)) {
-				reg = r;
+		for (r = m->registry; r->handler; r++)
+			if (!strcmp(r->type, type))
+				return r;
+	}
+
+	return NULL;
+}
+
+static int
+handler_batch(struct blob_attr **msg)
+{
+	struct blob_attr *tb[__BATCH_MAX], *tb_cmd[__BATCH_CMD_MAX];
+	struct blob_attr *sub[__MSG_MAX];
+	struct blob_attr *cur;
+	bool cont = false;
+	int failed = 0;
+	int rem;
+	void *a;
+
+	if (!msg[MSG_DATA] || (blobmsg_type(msg[MSG_DATA]) != BLOBMSG_TYPE_TABLE))
+		return -EINVAL;
+
+	blobmsg_parse(batch_policy, __BATCH_MAX, tb, blobmsg_data(msg[MSG_DATA]), blobmsg_len(msg[MSG_DATA]));
+	if (!tb[BATCH_CMDS])
+		return -EINVAL;
+
+	if (tb[BATCH_CONTINUE])
+		cont = blobmsg_get_bool(tb[BATCH_CONTINUE]);
+
+	memcpy(sub, msg, sizeof(sub));
+	a = blobmsg_open_array(&udrone.out, "results");
+	blobmsg_for_each_attr(cur, tb[BATCH_CMDS], rem) {
+		struct udrone_registry *reg = NULL;
+		int stat;
+		void *c, *d;
+
+		memset(tb_cmd, 0, sizeof(tb_cmd));
+		if (blobmsg_type(cur) == BLOBMSG_TYPE_TABLE)
+			blobmsg_parse(batch_cmd_policy, __BATCH_CMD_MAX, tb_cmd, blobmsg_data(cur), blobmsg_len(cur));
+
+		c = blobmsg_open_table(&udrone.out, NULL);
+		if (tb_cmd[BATCH_CMD_TYPE]) {
+			blobmsg_add_string(&udrone.out, "type", blobmsg_get_string(tb_cmd[BATCH_CMD_TYPE]));
+			reg = udrone_lookup(blobmsg_get_string(tb_cmd[BATCH_CMD_TYPE]));
+		}
+
+		d = blobmsg_open_table(&udrone.out, "data");
+		if (!tb_cmd[BATCH_CMD_TYPE]) {
+			stat = -EINVAL;
+		} else if (!reg || reg->handler == handler_batch) {
+			/* Unknown or nested batch */
+			stat = -ENOTSUP;
+		} else {
+			sub[MSG_TYPE] = tb_cmd[BATCH_CMD_TYPE];
+			sub[MSG_DATA] = tb_cmd[BATCH_CMD_DATA];
+			stat = reg->handler(sub);
+		}
+		blobmsg_close_table(&udrone.out, d);
+
+		stat = (stat > 0) ? 0 : -stat;
+		blobmsg_add_u32(&udrone.out, "code", stat);
+		if (stat)
+			blobmsg_add_string(&udrone.out, "errstr", strerror(stat));
+		blobmsg_close_table(&udrone.out, c);
+
+		if (stat) {
+			failed++;
+			if (!cont)
 				break;
-			}
 		}
 	}
+	blobmsg_close_array(&udrone.out, a);
+	blobmsg_add_u32(&udrone.out, "failed", failed);
+
+	return UDRONE_DATAREPLY;
+}
+
+int
+udrone_flags(struct udrone_registry *reg, struct blob_attr **msg)
+{
+	struct blob_attr *tb[__BATCH_MAX], *tb_cmd[__BATCH_CMD_MAX];
+	struct blob_attr *cur;
+	bool atomic = false, worker = false;
+	int rem;
+
+	if (reg->handler != handler_batch)
+		return reg->flags;
+
+	/* A batch only needs a worker if one of its commands does */
+	if (!msg[MSG_DATA] || (blobmsg_type(msg[MSG_DATA]) != BLOBMSG_TYPE_TABLE))
+		return UDRONE_HANDLER_ATOMIC;
+
+	blobmsg_parse(batch_policy, __BATCH_MAX, tb, blobmsg_data(msg[MSG_DATA]), blobmsg_len(msg[MSG_DATA]));
+	blobmsg_for_each_attr(cur, tb[BATCH_CMDS], rem) {
+		struct udrone_registry *r;
 
-	udrone_prepare(msg, type);
+		if (blobmsg_type(cur) != BLOBMSG_TYPE_TABLE)
+			continue;
+
+		blobmsg_parse(batch_cmd_policy, __BATCH_CMD_MAX, tb_cmd, blobmsg_data(cur), blobmsg_len(cur));
+		if (!tb_cmd[BATCH_CMD_TYPE])
+			continue;
+
+		r = udrone_lookup(blobmsg_get_string(tb_cmd[BATCH_CMD_TYPE]));
+		if (!r)
+			continue;
+		if (r->flags & UDRONE_HANDLER_ATOMIC)
+			atomic = true;
+		else
+			worker = true;
+	}
+
+	/* Atomic commands rely on daemon state that a worker does not share */
+	if (worker)
+		return atomic ? UDRONE_HANDLER_MIXED : 0;
+
+	return UDRONE_HANDLER_ATOMIC;
+}
+
+int
+udrone_exec(struct udrone_registry *reg, struct blob_attr **msg)
+{
+	int stat;
+	void *c;
+
+	udrone_prepare(msg, blobmsg_get_string(msg[MSG_TYPE]));
 	c = blobmsg_open_table(&udrone.out, "data");
+	stat = reg->handler(msg);
+	if (stat <= 0)
+		udrone_prepare_status(msg, -stat);
+	else
+		blobmsg_close_table(&udrone.out, c);
+
+	return stat;
+}
+
+static const struct udrone_profile *
+udrone_msg_profile(struct udrone_registry *reg, struct blob_attr **msg)
+{
+	return udrone_profile_find(msg[MSG_PROFILE] ?
+				   blobmsg_get_string(msg[MSG_PROFILE]) : reg->profile);
+}
+
+static void
+udrone_add_sched(struct udrone_channel *chan, struct timespec *fired)
+{
+	void *c;
+
+	c = blobmsg_open_table(&udrone.out, "schedule");
+	blobmsg_add_u64(&udrone.out, "at", (uint64_t) chan->sched_at.tv_sec * 1000 +
+			chan->sched_at.tv_nsec / 1000000);
+	blobmsg_add_u64(&udrone.out, "late_us", udrone_ts_us(&chan->sched_at, fired));
+	blobmsg_close_table(&udrone.out, c);
+}
+
+static void
+udrone_worker(struct udrone_channel *chan, struct udrone_registry *reg,
+	      struct blob_attr **msg, int trigger)
+{
+	const struct udrone_profile *prof = udrone_msg_profile(reg, msg);
+	struct timespec fired;
+	int stat;
+	char c;
+
+	close(udrone.sock.fd);
+	udrone_profile_apply(prof);
+
+	/* Pre-forked for a scheduled command, wait for the deadline */
+	if (trigger >= 0) {
+		if (read(trigger, &c, 1) != 1)
+			_exit(0);
+		clock_gettime(CLOCK_REALTIME, &fired);
+		close(trigger);
+	}
+
+	stat = udrone_exec(reg, msg);
+	if (trigger >= 0)
+		udrone_add_sched(chan, &fired);
+	udrone_profile_usage(prof);
+	udrone_add_timing(msg);
+	if (blob_pad_len(udrone.out.head) > UDRONE_MAX_DGRAM)
+		udrone_prepare_status(msg, EMSGSIZE);
+	memcpy(chan->worker_buf, udrone.out.head, blob_pad_len(udrone.out.head));
+	exit(stat);
+}
+
+static void
+udrone_msg_cmd(struct udrone_channel *chan, struct blob_attr **msg)
+{
+	struct udrone_registry *reg = udrone_lookup(blobmsg_get_string(msg[MSG_TYPE]));
+	int flags = reg ? udrone_flags(reg, msg) : 0;
+
 	if (!reg || !reg->handler) {
 		/* No handler */
-		stat = -ENOTSUP;
-	} else if (reg->flags & UDRONE_HANDLER_ATOMIC) {
-		/* Atomic handler */
-		stat = reg->handler(msg);
+		udrone_prepare_status(msg, ENOTSUP);
+	} else if (flags & UDRONE_HANDLER_MIXED) {
+		/* Batch mixing atomic and worker commands */
+		udrone_prepare_status(msg, EINVAL);
+	} else if (flags & UDRONE_HANDLER_ATOMIC) {
+		/* Atomic handler, deferred ones reply again once they complete */
+		defer_chan = (reg->flags & UDRONE_HANDLER_DEFERRED) ? chan : NULL;
+		if (udrone_exec(reg, msg) == UDRONE_DEFERRED)
+			udrone_prepare_accept(msg);
+		else if (chan->req)
+			udrone_request_free(chan->req, false);
+		defer_chan = NULL;
+	} else if (msg[MSG_PROFILE] && !udrone_profile_find(blobmsg_get_string(msg[MSG_PROFILE]))) {
+		/* Unknown execution profile */
+		udrone_prepare_status(msg, EINVAL);
+	} else if (!udrone_admit(UDRONE_ADMIT_FORK)) {
+		/* Fork rate exceeded */
+		udrone_prepare_status(msg, EAGAIN);
 	} else {
-		if (!(udrone.worker.pid = fork())) {
-			close(udrone.sock.fd);
-			stat = reg->handler(msg);
-			if (stat <= 0)
-				udrone_prepare_status(msg, -stat);
-			else
-				blobmsg_close_table(&udrone.out, c);
-			strncpy(udrone.worker_buf, blobmsg_format_json(udrone.out.head, 1), UDRONE_MAX_DGRAM);
-			exit(stat);
-		}
-		uloop_process_add(&udrone.worker);
+		if (!(chan->worker.pid = fork()))
+			udrone_worker(chan, reg, msg, -1);
+		uloop_process_add(&chan->worker);
 		udrone_prepare_accept(msg);
-		return;
 	}
-	if (stat <= 0)
-		udrone_prepare_status(msg, -stat);
-	else
-		blobmsg_close_table(&udrone.out, c);
+}
 
+static bool
+udrone_get_int(struct blob_attr *attr, int64_t *val)
+{
+	switch (blobmsg_type(attr)) {
+	case BLOBMSG_TYPE_INT64:
+		*val = blobmsg_get_u64(attr);
+		return true;
+	case BLOBMSG_TYPE_INT32:
+		*val = (int32_t) blobmsg_get_u32(attr);
+		return true;
+	case BLOBMSG_TYPE_DOUBLE:
+		*val = blobmsg_get_double(attr);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void
+udrone_sched_cb(struct uloop_timeout *t)
+{
+	struct udrone_channel *chan = container_of(t, struct udrone_channel, sched);
+	struct timespec fired;
+
+	if (chan->sched_fd >= 0) {
+		/* Release the pre-forked worker */
+		if (write(chan->sched_fd, "", 1) != 1)
+			syslog(LOG_WARNING, "Unable to start scheduled worker: %s", strerror(errno));
+		close(chan->sched_fd);
+		chan->sched_fd = -1;
+	} else {
+		clock_gettime(CLOCK_REALTIME, &fired);
+		udrone.cur = chan;
+		udrone_exec(chan->sched_reg, chan->sched_tb);
+		udrone_add_sched(chan, &fired);
+		free(chan->reply);
+		chan->reply = blob_memdup(udrone.out.head);
+		udrone_send(chan->reply, &chan->addr);
+	}
+
+	free(chan->sched_msg);
+	chan->sched_msg = NULL;
+	udrone_seq_kick(chan);
 }
 
 static int
-udrone_msg_ctrl(struct blob_attr **msg)
+udrone_msg_sched(struct udrone_channel *chan, struct blob_attr **msg)
 {
-	char *type = blobmsg_get_string(msg[MSG_TYPE]);
-	struct blob_attr *tb_whois[__WHOIS_MAX];
-	struct blob_attr *tb[__ASSIGN_MAX];
+	struct udrone_registry *reg = udrone_lookup(blobmsg_get_string(msg[MSG_TYPE]));
+	struct timespec now;
+	int64_t at, delay, val;
+	int fds[2];
 
-	if (!strcmp(type, "!whois")) {
-		if (!msg[MSG_DATA] || (blobmsg_type(msg[MSG_DATA]) != BLOBMSG_TYPE_TABLE))
-			return -ENOTSUP;
+	if (!reg || !reg->handler)
+		return -ENOTSUP;
 
-		blobmsg_parse(whois_policy, __WHOIS_MAX, tb_whois, blobmsg_data(msg[MSG_DATA]), blobmsg_len(msg[MSG_DATA]));
-		if (!tb_whois[WHOIS_BOARD])
-			return -ENOTSUP;
+	if (msg[MSG_PROFILE] && !udrone_profile_find(blobmsg_get_string(msg[MSG_PROFILE])))
+		return -EINVAL;
 
-		if (strcmp(udrone.board, blobmsg_get_string(tb_whois[WHOIS_BOARD])))
-			return -ENOTSUP;
+	if (udrone_flags(reg, msg) & UDRONE_HANDLER_MIXED)
+		return -EINVAL;
 
-		return 0;
+	if (!udrone_get_int(msg[MSG_AT] ? msg[MSG_AT] : msg[MSG_DELAY], &val))
+		return -EINVAL;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (msg[MSG_AT]) {
+		at = val;
+		delay = at - ((int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000);
+	} else {
+		/* Relative to the receive timestamp */
+		delay = val - udrone_ts_us(&udrone.rx_ts, &now) / 1000;
+		at = (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000 + delay;
 	}
 
-	if (!strcmp(type, "!assign")) {
-		if (!msg[MSG_DATA] || (blobmsg_type(msg[MSG_DATA]) != BLOBMSG_TYPE_TABLE))
-			return -EINVAL;
+	if (delay < -UDRONE_SCHED_SLACK)
+		return -ETIME;
+	if (delay > UDRONE_SCHED_MAX)
+		return -ERANGE;
+
+	/* Parse and look up now so that only the handler runs at the deadline */
+	chan->sched_msg = blob_memdup(udrone.in.head);
+	blobmsg_parse(msg_policy, __MSG_MAX, chan->sched_tb, blob_data(chan->sched_msg), blob_len(chan->sched_msg));
+	chan->sched_reg = reg;
+	chan->sched_at.tv_sec = at / 1000;
+	chan->sched_at.tv_nsec = (at % 1000) * 1000000;
+
+	if (!(udrone_flags(reg, chan->sched_tb) & UDRONE_HANDLER_ATOMIC)) {
+		if (!udrone_admit(UDRONE_ADMIT_FORK)) {
+			free(chan->sched_msg);
+			chan->sched_msg = NULL;
+			return -EAGAIN;
+		}
+
+		if (pipe(fds)) {
+			free(chan->sched_msg);
+			chan->sched_msg = NULL;
+			return -errno;
+		}
+
+		if (!(chan->worker.pid = fork())) {
+			close(fds[1]);
+			udrone_worker(chan, reg, chan->sched_tb, fds[0]);
+		}
+		close(fds[0]);
+		chan->sched_fd = fds[1];
+		uloop_process_add(&chan->worker);
+	}
+
+	uloop_timeout_set(&chan->sched, delay > 0 ? delay : 0);
+
+	return 0;
+}
+
+/* Whether a "!whois" asks for our board */
+int
+udrone_parse_whois(struct blob_attr **msg)
+{
+	struct blob_attr *tb[__WHOIS_MAX];
 
-		blobmsg_parse(assign_policy, __ASSIGN_MAX, tb, blobmsg_data(msg[MSG_DATA]), blobmsg_len(msg[MSG_DATA]));
+	if (!msg[MSG_DATA] || (blobmsg_type(msg[MSG_DATA]) != BLOBMSG_TYPE_TABLE))
+		return -ENOTSUP;
 
-		if (!tb[ASSIGN_GROUP] || !strcmp(blobmsg_get_string(tb[ASSIGN_GROUP]), UDRONE_GROUP_DEFAULT))
-			return -EINVAL;
+	blobmsg_parse(whois_policy, __WHOIS_MAX, tb, blobmsg_data(msg[MSG_DATA]), blobmsg_len(msg[MSG_DATA]));
+	if (!tb[WHOIS_BOARD])
+		return -ENOTSUP;
 
-		strcpy(udrone.group, blobmsg_get_string(tb[ASSIGN_GROUP]));
+	if (strcmp(udrone.board, blobmsg_get_string(tb[WHOIS_BOARD])))
+		return -ENOTSUP;
+
+	return 0;
+}
+
+/* Group and optional sequence ID of an "!assign" */
+int
+udrone_parse_assign(struct blob_attr **msg, char **grp, struct blob_attr **seq)
+{
+	struct blob_attr *tb[__ASSIGN_MAX];
 
-		if (tb[ASSIGN_SEQ])
-			udrone.assigned = blobmsg_get_u32(tb[ASSIGN_SEQ]);
+	if (!msg[MSG_DATA] || (blobmsg_type(msg[MSG_DATA]) != BLOBMSG_TYPE_TABLE))
+		return -EINVAL;
+
+	blobmsg_parse(assign_policy, __ASSIGN_MAX, tb, blobmsg_data(msg[MSG_DATA]), blobmsg_len(msg[MSG_DATA]));
+
+	if (!tb[ASSIGN_GROUP] || !strcmp(blobmsg_get_string(tb[ASSIGN_GROUP]), UDRONE_GROUP_DEFAULT))
+		return -EINVAL;
+
+	*grp = blobmsg_get_string(tb[ASSIGN_GROUP]);
+	if (strlen(*grp) >= sizeof(udrone.chan[0].group))
+		return -EINVAL;
+
+	*seq = tb[ASSIGN_SEQ];
+	return 0;
+}
+
+static int
+udrone_msg_ctrl(struct udrone_channel *chan, struct blob_attr **msg,
+		struct sockaddr_in *sender)
+{
+	char *type = blobmsg_get_string(msg[MSG_TYPE]);
+	struct udrone_channel *other;
+	struct blob_attr *seq;
+	char *grp;
+	int ret;
+
+	if (!strcmp(type, "!whois"))
+		return udrone_parse_whois(msg);
+
+	if (!strcmp(type, "!assign")) {
+		ret = udrone_parse_assign(msg, &grp, &seq);
+		if (ret)
+			return ret;
+
+		/* A group can only be driven through one channel */
+		other = udrone_channel_find(grp, "");
+		if (other && other != chan)
+			return -EBUSY;
+
+		strcpy(chan->group, grp);
+		strncpy(chan->master, blobmsg_get_string(msg[MSG_FROM]), sizeof(chan->master) - 1);
+		chan->addr = *sender;
+
+		/* Without the group address the host would talk to nobody */
+		ret = udrone_group_join(chan);
+		if (ret) {
+			udrone_reset(chan, UDRONE_GROUP_DEFAULT);
+			return ret;
+		}
 
-		udrone_reset_timer();
+		/* Held commands belong to the old sequence */
+		if (seq && blobmsg_get_u32(seq) != chan->assigned) {
+			udrone_seq_flush(chan);
+			chan->assigned = blobmsg_get_u32(seq);
+		}
+
+		udrone_reset_timer(chan);
 		return 0;
 	}
 
 	if (!strcmp(type, "!reset")) {
-		udrone_reset(UDRONE_GROUP_DEFAULT);
+		udrone_reset(chan, UDRONE_GROUP_DEFAULT);
 		return 0;
 	}
 
 	return -ENOTSUP;
 }
 
-static int
-udrone_read(struct blob_attr **tb, struct sockaddr_in *sender)
+int
+udrone_parse(struct blob_attr **tb, const char *data, size_t len)
 {
-	socklen_t addrlen = sizeof(*sender);
-	char data[UDRONE_MAX_DGRAM];
-	char addr[16] = {0};
-	ssize_t len;
-
-	len = recvfrom(udrone.sock.fd, data, sizeof(data) - 1, MSG_TRUNC | MSG_DONTWAIT,
-		       (struct sockaddr*)sender, &addrlen);
-
-	if (len == -1 && errno == EAGAIN)
-		return 0;
-	if (len < 16 || len >= sizeof(data))
-		return -1;
-	data[len] = 0;
-
-	if (data[0] != '{')
+	if (len < 16 || data[0] != '{')
 		return -1;
 
-	fprintf(stderr, "recv \t%s\n", data);
-
 	blob_buf_init(&udrone.in, 0);
 	if (!blobmsg_add_json_from_string(&udrone.in, data))
 		return -1;
@@ -309,65 +1025,467 @@ udrone_read(struct blob_attr **tb, struct sockaddr_in *sender)
 	if (!tb[MSG_TO] || !tb[MSG_FROM] || !tb[MSG_TYPE])
 		return -1;
 
-	strncpy(addr, blobmsg_get_string(tb[MSG_TO]), sizeof(addr));
+	return 1;
+}
 
-	if (strcmp(addr, udrone.uniqueid) && strcmp(addr, udrone.group))
+static int32_t
+udrone_seq_diff(struct udrone_channel *chan, uint32_t seq)
+{
+	return (int32_t) (seq - chan->assigned);
+}
+
+/* Where a command lies relative to the last sequence ID that ran */
+int
+udrone_seq_check(uint32_t assigned, uint32_t seq)
+{
+	int32_t diff = (int32_t) (seq - assigned);
+
+	if (!diff)
+		return UDRONE_SEQ_RESEND;
+	if (diff == 1)
+		return UDRONE_SEQ_NEXT;
+	if (diff < 0 && diff > -UDRONE_SEQ_WINDOW)
+		return UDRONE_SEQ_DUP;
+	if (diff > 1 && diff <= UDRONE_SEQ_AHEAD)
+		return UDRONE_SEQ_HOLD;
+
+	return UDRONE_SEQ_LOST;
+}
+
+/* Tell the host which commands to resend, held has a bit per held sequence ID */
+void
+udrone_prepare_gap(struct blob_attr **tb, uint32_t assigned, uint32_t held)
+{
+	int32_t diff = (int32_t) (blobmsg_get_u32(tb[MSG_SEQ]) - assigned);
+	void *c, *a;
+	int i;
+
+	udrone_prepare(tb, "gap");
+	c = blobmsg_open_table(&udrone.out, "data");
+	a = blobmsg_open_array(&udrone.out, "missing");
+	for (i = 0; i < diff - 1; i++)
+		if (!(held & (1 << i)))
+			blobmsg_add_u32(&udrone.out, NULL, assigned + 1 + i);
+	blobmsg_close_array(&udrone.out, a);
+	blobmsg_close_table(&udrone.out, c);
+}
+
+static void
+udrone_seq_hold(struct udrone_channel *chan, struct blob_attr **tb, struct sockaddr_in *sender)
+{
+	uint32_t seq = blobmsg_get_u32(tb[MSG_SEQ]);
+	int32_t diff = udrone_seq_diff(chan, seq);
+	struct udrone_pending *p = &chan->ahead[seq % UDRONE_SEQ_AHEAD];
+
+	if (!(chan->ahead_mask & (1 << (diff - 1)))) {
+		p->msg = blob_memdup(udrone.in.head);
+		p->addr = *sender;
+		p->ts = udrone.rx_ts;
+		if (p->msg)
+			chan->ahead_mask |= 1 << (diff - 1);
+	}
+
+	udrone_prepare_gap(tb, chan->assigned, chan->ahead_mask);
+}
+
+static struct blob_attr *
+udrone_run(struct udrone_channel *chan, struct blob_attr **tb, struct sockaddr_in *sender)
+{
+	struct udrone_pending *p = &chan->ahead[(chan->assigned + 1) % UDRONE_SEQ_AHEAD];
+	int ret;
+
+	chan->addr = *sender;
+	if (tb[MSG_AT] || tb[MSG_DELAY]) {
+		/* Scheduled command */
+		ret = udrone_msg_sched(chan, tb);
+		if (ret)
+			udrone_prepare_status(tb, -ret);
+		else
+			udrone_prepare_accept(tb);
+	} else {
+		/* New command */
+		udrone_msg_cmd(chan, tb);
+	}
+
+	/* A held copy of the same command is obsolete now */
+	if (chan->ahead_mask & 1) {
+		free(p->msg);
+		p->msg = NULL;
+	}
+	chan->ahead_mask >>= 1;
+	chan->assigned++;
+
+	udrone_reset_timer(chan);
+	udrone_add_timing(tb);
+	free(chan->reply);
+	chan->reply = blob_memdup(udrone.out.head);
+	udrone_seq_kick(chan);
+
+	return chan->reply;
+}
+
+static void
+udrone_drain_cb(struct uloop_timeout *t)
+{
+	struct udrone_channel *chan = container_of(t, struct udrone_channel, drain);
+	struct udrone_pending *p = &chan->ahead[(chan->assigned + 1) % UDRONE_SEQ_AHEAD];
+	struct blob_attr *tb[__MSG_MAX];
+	struct sockaddr_in addr = p->addr;
+	struct blob_attr *reply;
+
+	if (!(chan->ahead_mask & 1) || udrone_busy(chan))
+		return;
+
+	/* Replay the held command as if it just arrived */
+	blob_buf_init(&udrone.in, 0);
+	blob_put_raw(&udrone.in, blob_data(p->msg), blob_len(p->msg));
+	blobmsg_parse(msg_policy, __MSG_MAX, tb, blob_data(udrone.in.head), blob_len(udrone.in.head));
+	udrone.rx_ts = p->ts;
+	clock_gettime(CLOCK_REALTIME, &udrone.dispatch_ts);
+	udrone.cur = chan;
+
+	reply = udrone_run(chan, tb, &addr);
+	if (reply)
+		udrone_send(reply, &addr);
+}
+
+/* An "!assign" that changes neither group, host nor sequence ID */
+static bool
+udrone_renewal(struct udrone_channel *chan, struct blob_attr **tb)
+{
+	struct blob_attr *seq;
+	char *grp;
+
+	if (strcmp(blobmsg_get_string(tb[MSG_TYPE]), "!assign") ||
+	    udrone_parse_assign(tb, &grp, &seq) || !seq)
+		return false;
+
+	return blobmsg_get_u32(seq) == chan->assigned && !strcmp(grp, chan->group) &&
+		!strcmp(blobmsg_get_string(tb[MSG_FROM]), chan->master);
+}
+
+/* Renewals don't compete with other hosts' control traffic */
+static bool
+udrone_dispatch_admit(struct udrone_channel *chan, struct blob_attr **tb)
+{
+	if (blobmsg_get_string(tb[MSG_TYPE])[0] != '!')
+		return udrone_admit(UDRONE_ADMIT_COMMAND);
+
+	return udrone_renewal(chan, tb) || udrone_admit(UDRONE_ADMIT_CONTROL);
+}
+
+struct blob_attr *
+udrone_dispatch(struct blob_attr **tb, struct sockaddr_in *sender)
+{
+	struct udrone_channel *chan;
+	uint32_t seq;
+	char *type;
+
+	chan = udrone_channel_find(blobmsg_get_string(tb[MSG_TO]),
+				   blobmsg_get_string(tb[MSG_FROM]));
+	if (!chan)
+		return NULL;
+
+	/* Only charged once we know the message is for us */
+	type = blobmsg_get_string(tb[MSG_TYPE]);
+	if (!udrone_dispatch_admit(chan, tb))
+		return NULL;
+
+	clock_gettime(CLOCK_REALTIME, &udrone.dispatch_ts);
+	udrone.cur = chan;
+	seq = blobmsg_get_u32(tb[MSG_SEQ]);
+	if (type[0] == '!') {
+		/* Control messages, negative codes are not answered */
+		int ret = udrone_msg_ctrl(chan, tb, sender);
+
+		if (ret < 0)
+			return NULL;
+		udrone_prepare_ctrl(tb, ret);
+		if (chan->assigned)
+			udrone_reset_timer(chan);
+		udrone_add_timing(tb);
+		return udrone.out.head;
+	}
+
+	switch (udrone_seq_check(chan->assigned, seq)) {
+	case UDRONE_SEQ_RESEND:
+		/* Resend lost message */
+		udrone_reset_timer(chan);
+		if (!udrone_busy(chan))
+			return chan->reply;
+		udrone_prepare_accept(tb);
+		break;
+	case UDRONE_SEQ_DUP:
+		/* Command already ran, its reply is gone */
+		udrone_prepare_status(tb, EALREADY);
+		break;
+	case UDRONE_SEQ_HOLD:
+		/* Command overtook a lost or delayed one */
+		udrone_seq_hold(chan, tb, sender);
+		udrone_reset_timer(chan);
+		break;
+	case UDRONE_SEQ_LOST:
+		/* Out of sync */
+		udrone_prepare_status(tb, ESRCH);
+		udrone_timeout(&chan->timeout);
+		break;
+	default:
+		if (!udrone_busy(chan))
+			return udrone_run(chan, tb, sender);
+
+		/* Busy */
+		udrone_prepare_status(tb, EBUSY);
+		break;
+	}
+
+	udrone_add_timing(tb);
+	return udrone.out.head;
+}
+
+/*
+ * Cheap look at the raw datagram for a "type" starting with '!', so that
+ * control messages are admitted through their own per-source bucket and
+ * considered for overtaking. A wrong guess is harmless, the parser has the
+ * last word and messages only overtake what they can't affect.
+ */
+static bool
+udrone_classify(const char *data)
+{
+	const char *p = strstr(data, "\"type\"");
+
+	if (!p)
+		return false;
+
+	for (p += 6; *p == ' ' || *p == '\t' || *p == ':'; p++)
+		;
+
+	return p[0] == '"' && p[1] == '!';
+}
+
+/*
+ * Cheap look at the raw datagram for a "to" naming us or one of our
+ * groups. Fleet traffic for other nodes shares the default address and
+ * must neither be parsed nor charged to the sender. Anything unclear is
+ * left to the parser.
+ */
+static bool
+udrone_rx_ours(const char *data)
+{
+	const char *p = data, *end;
+	size_t len;
+	int i;
+
+	while ((p = strstr(p, "\"to\""))) {
+		for (p += 4; *p == ' ' || *p == '\t' || *p == ':'; p++)
+			;
+		if (*p != '"')
+			return true;
+
+		end = strchr(++p, '"');
+		if (!end || memchr(p, '\\', end - p))
+			return true;
+
+		len = end - p;
+		if (strlen(udrone.uniqueid) == len && !strncmp(p, udrone.uniqueid, len))
+			return true;
+		for (i = 0; i < UDRONE_MAX_CHANNELS; i++)
+			if (strlen(udrone.chan[i].group) == len &&
+			    !strncmp(p, udrone.chan[i].group, len))
+				return true;
+		p = end;
+	}
+
+	return false;
+}
+
+static int
+udrone_recv(struct udrone_dgram *d)
+{
+	char cbuf[CMSG_SPACE(sizeof(struct udrone_tstamp))];
+	struct iovec iov = {
+		.iov_base = d->data,
+		.iov_len = sizeof(d->data) - 1,
+	};
+	struct msghdr mh = {
+		.msg_name = &d->addr,
+		.msg_namelen = sizeof(d->addr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	len = recvmsg(udrone.sock.fd, &mh, MSG_TRUNC | MSG_DONTWAIT);
+
+	if (len == -1 && errno == EAGAIN)
+		return 0;
+	if (len < 16 || len >= sizeof(d->data))
 		return -1;
 
+	d->data[len] = 0;
+	d->len = len;
+
+	/* Drop other nodes' traffic and floods before spending time on parsing */
+	if (!udrone.sim && !udrone_rx_ours(d->data))
+		return -1;
+	d->ctrl = udrone_classify(d->data);
+	if (!udrone_admit_source(d->addr.sin_addr, d->ctrl))
+		return -1;
+
+	/* Prefer the kernel receive timestamp */
+	clock_gettime(CLOCK_REALTIME, &d->ts);
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		struct udrone_tstamp *ts = (struct udrone_tstamp *) CMSG_DATA(cmsg);
+
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING &&
+		    ts->ts[0].tv_sec)
+			d->ts = ts->ts[0];
+	}
+
 	return 1;
 }
 
+static int
+udrone_load(struct blob_attr **tb, struct udrone_dgram *d)
+{
+	udrone.rx_ts = d->ts;
+	fprintf(stderr, "recv \t%s\n", d->data);
+
+	return udrone_parse(tb, d->data, d->len);
+}
+
 static void
-udrone_read_cb(struct uloop_fd *u, unsigned int events)
+udrone_process(struct udrone_dgram *d)
 {
 	struct blob_attr *tb[__MSG_MAX] = { 0 };
-	struct sockaddr_in addr;
-	int status;
+	struct blob_attr *reply;
+
+	if (udrone_load(tb, d) <= 0)
+		return;
+
+	/* A drone farm is not limited like a single device */
+	if (udrone.sim) {
+		udrone_sim_dispatch(tb, &d->addr);
+		return;
+	}
+
+	reply = udrone_dispatch(tb, &d->addr);
+	if (reply)
+		udrone_send(reply, &d->addr);
+}
 
-	while ((status = udrone_read(tb, &addr))) {
-		char *type;
-		int seq;
+/* Channel a queued datagram is for, by the state before the batch ran */
+static struct udrone_channel *
+udrone_rx_chan(struct udrone_dgram *d)
+{
+	struct blob_attr *tb[__MSG_MAX] = { 0 };
+
+	if (!d->parsed && udrone_parse(tb, d->data, d->len) > 0)
+		d->chan = udrone_channel_find(blobmsg_get_string(tb[MSG_TO]),
+					      blobmsg_get_string(tb[MSG_FROM]));
+	d->parsed = true;
+
+	return d->chan;
+}
+
+/*
+ * Whether the control message at index i may run ahead of the batch. It
+ * must not overtake anything for its own channel, except that a renewal
+ * may overtake commands. Virtual drones have no channels to tell apart,
+ * so only their renewals overtake commands.
+ */
+static bool
+udrone_rx_early(int i)
+{
+	struct blob_attr *tb[__MSG_MAX] = { 0 };
+	struct udrone_dgram *d = &rx_queue[i];
+	bool renewal;
+	int j;
+
+	if (udrone_parse(tb, d->data, d->len) <= 0)
+		return true;
+
+	if (udrone.sim) {
+		renewal = udrone_sim_renewal(tb);
+	} else {
+		d->chan = udrone_channel_find(blobmsg_get_string(tb[MSG_TO]),
+					      blobmsg_get_string(tb[MSG_FROM]));
+		d->parsed = true;
+		if (!d->chan)
+			return true;
+		renewal = udrone_renewal(d->chan, tb);
+	}
+
+	for (j = 0; j < i; j++) {
+		struct udrone_dgram *prev = &rx_queue[j];
 
-		if (status <= 0)
+		if (prev->early)
 			continue;
+		if (renewal && !prev->ctrl)
+			continue;
+		if (udrone.sim || udrone_rx_chan(prev) == d->chan)
+			return false;
+	}
 
-		type = blobmsg_get_string(tb[MSG_TYPE]);
-		seq = blobmsg_get_u32(tb[MSG_SEQ]);
-		if (type[0] == '!') {
-			/* Control messages */
-			int ret = udrone_msg_ctrl(tb);
+	return true;
+}
 
-			if (ret < 0)
+static void
+udrone_read_cb(struct uloop_fd *u, unsigned int events)
+{
+	bool cmds;
+	int status, i, n;
+
+	do {
+		cmds = false;
+		for (n = 0; n < UDRONE_RX_BATCH; ) {
+			status = udrone_recv(&rx_queue[n]);
+			if (!status)
+				break;
+			if (status < 0)
 				continue;
-			udrone_prepare_ctrl(tb, -ret);
-			if (udrone.assigned)
-				udrone_reset_timer();
-		} else if (seq == udrone.assigned) {
-			/* Resend lost message */
-			if (udrone.worker.pending) {
-				udrone_prepare_accept(tb);
-			}
-			udrone_reset_timer();
-		} else if (seq != udrone.assigned + 1) {
-			/* Out of sync */
-			udrone_prepare_status(tb, ESRCH);
-			udrone_timeout(&udrone.timeout);
-		} else if (udrone.worker.pending) {
-			/* Busy */
-			udrone_prepare_status(tb, EBUSY);
-		} else {
-			/* New command */
-			udrone_msg_cmd(tb);
-			udrone.worker_addr = addr;
-			udrone.assigned++;
-			udrone_reset_timer();
+			rx_queue[n].early = false;
+			rx_queue[n].parsed = false;
+			rx_queue[n].chan = NULL;
+			n++;
 		}
 
-		udrone_send(addr);
-	}
+		/*
+		 * Renewals must not wait behind a backlog of commands, control
+		 * messages run first unless they could change how an earlier
+		 * message of the batch is handled. Parsing ahead is only needed
+		 * for control messages that follow a command.
+		 */
+		for (i = 0; i < n; i++) {
+			if (!rx_queue[i].ctrl)
+				cmds = true;
+			else
+				rx_queue[i].early = !cmds || udrone_rx_early(i);
+		}
+
+		for (i = 0; i < n; i++)
+			if (rx_queue[i].early)
+				udrone_process(&rx_queue[i]);
+		for (i = 0; i < n; i++)
+			if (!rx_queue[i].early)
+				udrone_process(&rx_queue[i]);
+	} while (n == UDRONE_RX_BATCH);
 }
 
-static void
+static struct udrone_registry core_handler[] =
+{
+	{ .type = "batch", .handler = handler_batch },
+	{ 0 }
+};
+
+static struct udrone_module core = {
+	.registry = core_handler,
+};
+UDRONE_MODULE_REGISTER(core)
+
+void
 udrone_generate_id(void)
 {
 	const char hexdigits[] = "0123456789abcdef";
@@ -387,12 +1505,26 @@ udrone_generate_id(void)
 }
 
 static void
+udrone_sockopt(int level, int opt, const char *name, int val)
+{
+	if (setsockopt(udrone.sock.fd, level, opt, &val, sizeof(val)))
+		syslog(LOG_WARNING, "Failed to set %s for low latency mode: %s",
+			name, strerror(errno));
+}
+
+void
 udrone_socket(void)
 {
 	struct ifreq ifr = {.ifr_name = ""};
 	struct ip_mreqn imr = {
 		.imr_address = {INADDR_ANY},
 	};
+	struct sockaddr_in addr = {
+		.sin_addr = {INADDR_ANY},
+		.sin_family = AF_INET,
+		.sin_port = htons(UDRONE_PORT),
+	};
+	int tstamp = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
 	int one = 1;
 
 	udrone.sock.fd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -404,20 +1536,26 @@ udrone_socket(void)
 	fcntl(udrone.sock.fd, F_SETOWN, getpid());
 	fcntl(udrone.sock.fd, F_SETFL, fcntl(udrone.sock.fd, F_GETFL) | O_NONBLOCK);
 	setsockopt(udrone.sock.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
-	addr.sin_port = htons(UDRONE_PORT);
+	setsockopt(udrone.sock.fd, SOL_SOCKET, SO_TIMESTAMPING, &tstamp, sizeof(tstamp));
+	if (udrone.lowlat) {
+		/* Each is optional, IP_TOS implies a priority so set SO_PRIORITY last */
+		udrone_sockopt(SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", UDRONE_BUSY_POLL);
+		udrone_sockopt(SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", UDRONE_RCVBUF);
+		udrone_sockopt(SOL_IP, IP_TOS, "IP_TOS", UDRONE_SOCK_TOS);
+		udrone_sockopt(SOL_SOCKET, SO_PRIORITY, "SO_PRIORITY", UDRONE_SOCK_PRIO);
+	}
 	if (bind(udrone.sock.fd, (struct sockaddr*)&addr, sizeof(addr))) {
 		syslog(LOG_ERR, "Failed to bind socket\n");
 		exit(EXIT_FAILURE);
 	}
-	inet_pton(AF_INET, UDRONE_ADDR, &addr.sin_addr);
 	strncpy(ifr.ifr_name, udrone.ifname, sizeof(ifr.ifr_name) - 1);
 	if (ioctl(udrone.sock.fd, SIOCGIFINDEX, &ifr)) {
 		syslog(LOG_ERR, "Unable to identify interface %s: %s",
 			udrone.ifname, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
-	imr.imr_ifindex = ifr.ifr_ifindex;
-	imr.imr_multiaddr = addr.sin_addr;
+	udrone.ifindex = imr.imr_ifindex = ifr.ifr_ifindex;
+	imr.imr_multiaddr = group_base;
 	if (setsockopt(udrone.sock.fd, SOL_IP, IP_ADD_MEMBERSHIP, &imr, sizeof(imr)) ||
 	    setsockopt(udrone.sock.fd, SOL_SOCKET, SO_BINDTODEVICE, udrone.ifname, strlen(udrone.ifname))) {
 		syslog(LOG_ERR, "Failed to setup multicast %s: %s",
@@ -427,50 +1565,49 @@ udrone_socket(void)
 	uloop_fd_add(&udrone.sock, ULOOP_READ);
 }
 
-static void
-ubus_connect_handler(struct ubus_context *ctx)
-{
-
-}
-
 int
-main(int argc, char **argv)
+udrone_init(void)
 {
-	if (argc < 2) {
-		fprintf(stderr, "udrone - Multicast drone client\n\nUsage: %s <interface>\n", *argv);
-		return EXIT_FAILURE;
-	}
+	int i;
 
-	if (argc > 2)
-		strncpy(udrone.board, argv[2], sizeof(udrone.board) - 1);
-	else
-		strncpy(udrone.board, "generic", sizeof(udrone.board) - 1);
+	inet_pton(AF_INET, UDRONE_ADDR, &group_base);
 
-	udrone.worker_buf = mmap(NULL, UDRONE_MAX_DGRAM, PROT_WRITE | PROT_READ,
-				 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	rx_queue = calloc(UDRONE_RX_BATCH, sizeof(*rx_queue));
+	if (!rx_queue)
+		return -1;
+
+	worker_buf = mmap(NULL, UDRONE_MAX_DGRAM * UDRONE_MAX_CHANNELS, PROT_WRITE | PROT_READ,
+			  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 
-        if (udrone.worker_buf == MAP_FAILED) {
+	if (worker_buf == MAP_FAILED) {
 		syslog(LOG_ERR, "Unable to create memory map: %s", strerror(errno));
-		return EXIT_FAILURE;
+		return -1;
 	}
 
-	udrone.ifname = argv[1];
-	udrone.worker.cb = udrone_worker_cb;
+	for (i = 0; i < UDRONE_MAX_CHANNELS; i++) {
+		struct udrone_channel *chan = &udrone.chan[i];
+
+		chan->worker_buf = worker_buf + i * UDRONE_MAX_DGRAM;
+		chan->worker.cb = udrone_worker_cb;
+		chan->sched.cb = udrone_sched_cb;
+		chan->drain.cb = udrone_drain_cb;
+		chan->sched_fd = -1;
+		chan->group_addr = group_base;
+		udrone_reset(chan, UDRONE_GROUP_DEFAULT);
+		udrone_reset_timer(chan);
+	}
 
-	uloop_init();
-	udrone.ubus.cb = ubus_connect_handler;
-        ubus_auto_connect(&udrone.ubus);
+	return 0;
+}
 
-	udrone_reset(UDRONE_GROUP_DEFAULT);
-	udrone_socket();
-	udrone_generate_id();
-	udrone_reset_timer();
-	uloop_run();
-	uloop_done();
-	ubus_auto_shutdown(&udrone.ubus);
+void
+udrone_done(void)
+{
+	int i;
 
-	munmap(udrone.worker_buf, UDRONE_MAX_DGRAM);
-	close(udrone.sock.fd);
+	for (i = 0; i < UDRONE_MAX_CHANNELS; i++)
+		udrone_reset(&udrone.chan[i], UDRONE_GROUP_DEFAULT);
 
-	return 0;
+	munmap(worker_buf, UDRONE_MAX_DGRAM * UDRONE_MAX_CHANNELS);
+	free(rx_queue);
 }
@@ -23,6 +23,7 @@
 #define UDRONE_H_
 
 #include <stdint.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <libubox/uloop.h>
 #include <libubox/blobmsg.h>
@@ -30,15 +31,60 @@
 #include <libubus.h>
 
 #define UDRONE_MAX_DGRAM		(32 * 1024)
+#define UDRONE_RX_BATCH			8
 #define UDRONE_GROUP_DEFAULT		"!all-default"
 #define UDRONE_GROUP_LOST		"!all-lost"
 #define UDRONE_GROUP_TIMEOUT		60
+#define UDRONE_SCHED_MAX		(3600 * 1000)
+#define UDRONE_SCHED_SLACK		1000
+#define UDRONE_SEQ_WINDOW		64
+#define UDRONE_SEQ_AHEAD		8
+#define UDRONE_MAX_CHANNELS		4
 
 #define UDRONE_PORT 21337
 #define UDRONE_ADDR "239.6.6.6"
+#define UDRONE_GROUP_NET "239.6.128.0/17"
+
+#define UDRONE_HASH_INIT 2166136261u
+
+#define UDRONE_BUSY_POLL	50
+#define UDRONE_RCVBUF		(256 * 1024)
+#define UDRONE_SOCK_PRIO	6
+#define UDRONE_SOCK_TOS		0xc0
 
 #define UDRONE_DATAREPLY 1
+#define UDRONE_DEFERRED 2
 #define UDRONE_HANDLER_ATOMIC 0x01
+#define UDRONE_HANDLER_DEFERRED 0x02
+#define UDRONE_HANDLER_MIXED 0x04
+
+enum {
+	UDRONE_SEQ_NEXT = 0,
+	UDRONE_SEQ_RESEND,
+	UDRONE_SEQ_DUP,
+	UDRONE_SEQ_HOLD,
+	UDRONE_SEQ_LOST,
+};
+
+enum {
+	MSG_TO = 0,
+	MSG_FROM,
+	MSG_SEQ,
+	MSG_TYPE,
+	MSG_DATA,
+	MSG_PROFILE,
+	MSG_TIMING,
+	MSG_AT,
+	MSG_DELAY,
+	__MSG_MAX
+};
+
+enum {
+	UDRONE_ADMIT_CONTROL = 0,
+	UDRONE_ADMIT_COMMAND,
+	UDRONE_ADMIT_FORK,
+	__UDRONE_ADMIT_MAX
+};
 
 typedef int(udrone_handler_t)(struct blob_attr **);
 
@@ -46,41 +92,139 @@ struct udrone_registry {
 	int flags;
 	char *type;
 	udrone_handler_t *handler;
+	const char *profile;
+};
+
+/* Limits applied to forked handlers */
+struct udrone_profile {
+	const char *name;
+	int nice;
+	int ioprio_class;
+	int ioprio;
+	const char *cpu_max;
+	const char *memory_max;
+	unsigned long cpus;
+};
+
+struct udrone_channel;
+
+/*
+ * A command taken over by udrone_defer(), completed from a later uloop
+ * callback. cancel is called if it times out or its channel is reset.
+ */
+struct udrone_request {
+	struct uloop_timeout timeout;
+	struct udrone_channel *chan;
+	struct sockaddr_in addr;
+	char to[32];
+	char type[32];
+	uint32_t seq;
+	bool timing;
+	struct timespec rx_ts;
+	struct timespec dispatch_ts;
+	void (*cancel)(struct udrone_request *req);
+	void *priv;
 };
 
 struct udrone_module {
 	struct udrone_module *next;
 	struct udrone_registry *registry;
+	void (*reset)(struct udrone_channel *chan);
+	void (*connect)(void);
 };
 
-struct udrone_ctx {
-	struct uloop_fd sock;
+/* A command that arrived ahead of its sequence ID */
+struct udrone_pending {
+	struct blob_attr *msg;
+	struct sockaddr_in addr;
+	struct timespec ts;
+};
+
+struct udrone_channel {
 	struct uloop_timeout timeout;
+	struct uloop_timeout sched;
+	struct uloop_timeout drain;
 	struct uloop_process worker;
-	struct ubus_auto_conn ubus;
-	struct sockaddr_in worker_addr;
+	struct sockaddr_in addr;
+	struct in_addr group_addr;
 	char *worker_buf;
+	struct blob_attr *reply;
+	struct blob_attr *sched_msg;
+	struct blob_attr *sched_tb[__MSG_MAX];
+	struct udrone_registry *sched_reg;
+	struct udrone_request *req;
+	struct timespec sched_at;
+	int sched_fd;
+	char group[32];
+	char master[32];
+	uint32_t assigned;
+	uint32_t ahead_mask;
+	struct udrone_pending ahead[UDRONE_SEQ_AHEAD];
+};
+
+struct udrone_ctx {
+	struct uloop_fd sock;
+	struct ubus_auto_conn ubus;
+	struct udrone_channel chan[UDRONE_MAX_CHANNELS];
+	struct udrone_channel *cur;
 	char board[64];
 	char uniqueid[32];
-	char group[32];
 	const char *ifname;
+	int ifindex;
+	struct in_addr group_net;
+	uint32_t group_mask;
+	bool lowlat;
+	int sim;
+	struct timespec rx_ts;
+	struct timespec dispatch_ts;
 	struct blob_buf in, out;
-	uint32_t assigned;
 };
 
 extern struct udrone_ctx udrone;
 
-enum {
-	MSG_TO = 0,
-	MSG_FROM,
-	MSG_SEQ,
-	MSG_TYPE,
-	MSG_DATA,
-	__MSG_MAX
-};
 
+int udrone_init(void);
+void udrone_done(void);
+void udrone_socket(void);
+void udrone_generate_id(void);
+
+int udrone_parse(struct blob_attr **tb, const char *data, size_t len);
+int udrone_parse_whois(struct blob_attr **msg);
+int udrone_parse_assign(struct blob_attr **msg, char **grp, struct blob_attr **seq);
+int udrone_seq_check(uint32_t assigned, uint32_t seq);
+struct blob_attr *udrone_dispatch(struct blob_attr **tb, struct sockaddr_in *sender);
+char *udrone_format(struct blob_attr *msg);
+
+const struct udrone_profile *udrone_profile_find(const char *name);
+void udrone_profile_init(void);
+void udrone_profile_apply(const struct udrone_profile *p);
+void udrone_profile_usage(const struct udrone_profile *p);
+
+int udrone_sim_init(int count, int latency, int loss);
+void udrone_sim_dispatch(struct blob_attr **tb, struct sockaddr_in *sender);
+bool udrone_sim_renewal(struct blob_attr **tb);
+
+bool udrone_admit_source(struct in_addr addr, bool ctrl);
+bool udrone_admit(int class);
+int udrone_admit_config(const char *arg);
+
+uint32_t udrone_hash(const void *data, size_t len, uint32_t hash);
 void udrone_prepare(struct blob_attr **tb, char *type);
+void udrone_prepare_notice(struct udrone_channel *chan, char *type);
+void udrone_prepare_status(struct blob_attr **tb, int code);
+void udrone_prepare_reply(const char *to, uint32_t seq, int code);
+void udrone_prepare_gap(struct blob_attr **tb, uint32_t assigned, uint32_t held);
+void udrone_prepare_ctrl(struct blob_attr **tb, int code);
+struct udrone_registry *udrone_lookup(const char *type);
+int udrone_flags(struct udrone_registry *reg, struct blob_attr **msg);
+int udrone_exec(struct udrone_registry *reg, struct blob_attr **msg);
+struct in_addr udrone_group_addr(const char *grp);
+int udrone_group_member(const char *grp, bool join);
+void udrone_send(struct blob_attr *msg, struct sockaddr_in *addr);
 void udrone_register(struct udrone_module *module);
+void udrone_connect(void);
+struct udrone_request *udrone_defer(struct blob_attr **msg, int timeout);
+void udrone_request_complete(struct udrone_request *req, int stat, struct blob_attr *data);
 
 #define UDRONE_MODULE_REGISTER(module) \
 static void __attribute__((constructor)) udrone_plugin_ctor_##module() { \